@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The most recent mutations of a store, encoded as SyncStream records. Every mutation moves the
+// store's offset up by one; a peer can be caught up from offset x as long as nothing after x has
+// been dropped yet.
+//
+// Each shard keeps its own part, numbered by the offset, and bounded by its share of limit
+// bytes: a mutation only takes the lock of the shard it logs to and the offset is an atomic, so
+// writes to different shards don't meet here. Whole-store mutations go to part 0. Append is
+// called under the lock of the part's shard, everything else under every shard lock.
+class Backlog {
+    struct Part {
+        std::deque<std::pair<uint64_t, std::string>> records;
+        size_t bytes = 0;
+        uint64_t dropped = 0;   // offset of the last record dropped from the front
+    };
+
+    std::vector<Part> parts;
+    size_t limit;
+    std::atomic<uint64_t> offset { 0 };
+
+public:
+    Backlog(size_t limit, size_t count) : parts(count > 0 ? count : 1), limit(limit / parts.size()) {}
+
+    uint64_t Offset() const { return offset; }
+
+    void Append(size_t part, std::string record) {
+        Part &p = parts[part];
+        p.bytes += record.size();
+        p.records.emplace_back(++ offset, std::move(record));
+
+        while(p.bytes > limit && !p.records.empty()) {
+            p.bytes -= p.records.front().second.size();
+            p.dropped = p.records.front().first;
+            p.records.pop_front();
+        }
+    }
+
+    // every mutation after offset is still here
+    bool Covers(uint64_t from) const {
+        for(auto &p : parts)
+            if(p.dropped > from) return false;
+        return from <= Offset();
+    }
+
+    // calls f(record) for the mutations after offset, oldest first
+    template<class F>
+    void ForEachAfter(uint64_t from, F &&f) const {
+        std::vector<size_t> next(parts.size());
+        for(size_t i = 0; i < parts.size(); i ++)
+            while(next[i] < parts[i].records.size() && parts[i].records[next[i]].first <= from) next[i] ++;
+
+        while(true) {
+            size_t oldest = parts.size();
+            for(size_t i = 0; i < parts.size(); i ++)
+                if(next[i] < parts[i].records.size() && (oldest == parts.size() || parts[i].records[next[i]].first < parts[oldest].records[next[oldest]].first))
+                    oldest = i;
+            if(oldest == parts.size()) return;
+
+            f(parts[oldest].records[next[oldest] ++].second);
+        }
+    }
+
+    // forgets every record, the store continues from offset
+    void Reset(uint64_t to) {
+        for(auto &p : parts) {
+            p.records.clear();
+            p.bytes = 0;
+            p.dropped = to;
+        }
+        offset = to;
+    }
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Blocked bloom filter: all the bits of a key are set inside one 64 byte block, so a query
+// costs a single cache miss. There are no false negatives, a negative answer means the key
+// was never added. Removing keys is not supported, the owner rebuilds the filter instead.
+class BloomFilter {
+    static constexpr size_t BLOCK_BITS = 512;
+    static constexpr size_t BITS_PER_KEY = 10;
+    static constexpr int PROBES = 7;
+
+    std::vector<uint64_t> bits;
+    size_t blockMask = 0, added = 0, capacity = 0;
+
+    static uint64_t Mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // calls f(word, bit) for every bit of the key
+    template<class F>
+    void Probe(size_t hash, F &&f) const {
+        // the shards already split keys on the low bits of the hash, pick the block from the high ones
+        size_t block = (((hash * 0x9e3779b97f4a7c15ULL) >> 32) & blockMask) * (BLOCK_BITS / 64);
+        uint64_t x = Mix(hash);
+        for(int i = 0; i < PROBES; i ++) {
+            // 9 bits pick one of the 512 bits of the block
+            f(block + ((x >> 6) & 7), 1ULL << (x & 63));
+            x = (x >> 9) | (x << 55);
+        }
+    }
+
+public:
+    explicit BloomFilter(size_t expected = 0) { Reset(expected); }
+
+    // empties the filter and sizes it for the expected number of keys
+    void Reset(size_t expected) {
+        size_t blocks = 1;
+        while(blocks * BLOCK_BITS < expected * BITS_PER_KEY) blocks *= 2;
+
+        bits.assign(blocks * (BLOCK_BITS / 64), 0);
+        blockMask = blocks - 1;
+        capacity = blocks * BLOCK_BITS / BITS_PER_KEY;
+        added = 0;
+    }
+
+    // more keys were added than it was sized for, false positives climb from here on
+    bool Saturated() const { return added > capacity; }
+
+    void Add(std::string_view key) {
+        Probe(std::hash<std::string_view>{}(key), [&](size_t word, uint64_t bit) { bits[word] |= bit; });
+        added ++;
+    }
+
+    bool MayContain(std::string_view key) const {
+        bool found = true;
+        Probe(std::hash<std::string_view>{}(key), [&](size_t word, uint64_t bit) { found &= (bits[word] & bit) != 0; });
+        return found;
+    }
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
+
+// Byte queue made of shared, immutable buffers. A message going to many connections is stored
+// once and every queue it is pushed to holds a reference, so queueing costs the same whatever
+// the message's size; the bytes are only touched again by the kernel, gathered by writev.
+class BufferQueue {
+public:
+    using Buffer = std::shared_ptr<const std::string>;
+
+    // most buffers handed to one writev
+    static constexpr int GATHER = 64;
+
+private:
+    std::deque<Buffer> buffers;
+    size_t offset = 0;      // bytes of the first buffer already written
+    size_t size = 0;        // bytes not written yet
+
+public:
+    size_t Size() const { return size; }
+    bool Empty() const { return size == 0; }
+
+    void Push(Buffer buffer) {
+        if(buffer->empty()) return;
+        size += buffer->size();
+        buffers.push_back(std::move(buffer));
+    }
+
+    // moves every buffer of other to the back of this queue
+    void Append(BufferQueue &other) {
+        for(auto &buffer : other.buffers) {
+            // only the first buffer can be partly written, and only its rest moves
+            if(other.offset) {
+                buffer = std::make_shared<const std::string>(*buffer, other.offset);
+                other.offset = 0;
+            }
+            buffers.push_back(std::move(buffer));
+        }
+        size += other.size;
+
+        other.buffers.clear();
+        other.size = 0;
+    }
+
+    // one writev of the first GATHER buffers; returns what writev did
+    ssize_t WriteTo(int fd) {
+        iovec iov[GATHER];
+        int count = std::min<size_t>(buffers.size(), GATHER);
+        for(int i = 0; i < count; i ++)
+            iov[i] = { (char *)buffers[i]->data() + (i ? 0 : offset), buffers[i]->size() - (i ? 0 : offset) };
+
+        ssize_t bytes = writev(fd, iov, count);
+        if(bytes <= 0) return bytes;
+
+        size -= bytes;
+        for(size_t left = bytes; left > 0; ) {
+            size_t first = buffers.front()->size() - offset;
+            if(left < first) {
+                offset += left;
+                break;
+            }
+            left -= first;
+            offset = 0;
+            buffers.pop_front();
+        }
+        return bytes;
+    }
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+
+// Commands as the clients, the hub and server mode pass them around: "SET key value TTL" and
+// the like, one space between the words. Parsing doesn't copy anything: a CMDStructure's key and
+// value point into the line it was parsed from, which has to outlive it.
+
+#define FOREACH_CMD(FUNC) \
+    FUNC(ERROR) \
+    FUNC(PUSH) \
+    FUNC(POP) \
+    FUNC(DELETESAVES) \
+    FUNC(SIZE) \
+    FUNC(PRINTALL) \
+    FUNC(GET) \
+    FUNC(DELETE) \
+    FUNC(SET) \
+    FUNC(PSET)
+
+#define ENUM(CMD) CMD,
+#define NAME(CMD) #CMD,
+
+enum CMD { FOREACH_CMD(ENUM) };
+
+constexpr std::string_view CMDNames[] = { FOREACH_CMD(NAME) };
+constexpr size_t CMD_COUNT = sizeof(CMDNames) / sizeof(CMDNames[0]);
+
+// Command names are looked up in a perfect hash table: the seed is searched for at compile time
+// so that no two names share a slot, and a lookup is one hash and one comparison.
+constexpr size_t CMD_SLOTS = 32;
+
+constexpr size_t CommandSlot(std::string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for(char c : name)
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    return (hash ^ (hash >> 15)) & (CMD_SLOTS - 1);
+}
+
+constexpr uint32_t CMD_SEED = [] {
+    for(uint32_t seed = 0; ; seed ++) {
+        bool used[CMD_SLOTS] = {};
+        bool collides = false;
+        for(size_t i = 0; i < CMD_COUNT && !collides; i ++) {
+            collides = used[CommandSlot(CMDNames[i], seed)];
+            used[CommandSlot(CMDNames[i], seed)] = true;
+        }
+        if(!collides) return seed;
+    }
+}();
+
+// slot -> command, ERROR where no name lands
+constexpr std::array<CMD, CMD_SLOTS> CMDSlots = [] {
+    std::array<CMD, CMD_SLOTS> slots = {};
+    for(size_t i = 0; i < CMD_COUNT; i ++)
+        slots[CommandSlot(CMDNames[i], CMD_SEED)] = CMD(i);
+    return slots;
+}();
+
+// ERROR for anything that isn't a command name
+constexpr CMD FindCommand(std::string_view name) {
+    CMD cmd = CMDSlots[CommandSlot(name, CMD_SEED)];
+    return CMDNames[cmd] == name ? cmd : ERROR;
+}
+
+static_assert(FindCommand("PSET") == PSET && FindCommand("GETS") == ERROR);
+
+// the longest TTL a pair can get, a century in milliseconds; a deadline never overflows
+constexpr time_t MAX_TTL = 100LL * 365 * 24 * 3600 * 1000;
+
+struct CMDStructure {
+    CMD CMDEnum;
+    std::string_view key = "";
+    std::string_view value = "";
+    time_t TTL = 0;     // seconds for SET, milliseconds for PSET
+
+    std::string toString() const {
+        std::string text = "CMD: ";
+        text.append(CMDNames[CMDEnum]).append(" | Key: ").append(key).append(" | Value: ").append(value);
+        return text.append(" | TTL: ").append(std::to_string(TTL));
+    }
+
+    std::string Serialize() const {
+        std::string text(CMDNames[CMDEnum]);
+        if(!key.empty()) text.append(" ").append(key);
+        if(!value.empty()) text.append(" ").append(value);
+        if(TTL > 0) text.append(" ").append(std::to_string(TTL));
+        return text;
+    }
+};
+
+// commands before GET take no arguments, GET and DELETE a key, SET and PSET a key, a value and a
+// positive TTL up to MAX_TTL; anything else is ERROR
+inline CMDStructure InputParser(std::string_view raw) {
+    std::string_view words[4];
+    size_t count = 0;
+    while(true) {
+        if(count == 4) return { ERROR };
+        size_t p = raw.find(' ');
+        words[count ++] = raw.substr(0, p);
+        if(p == std::string_view::npos) break;
+        raw.remove_prefix(p + 1);
+    }
+
+    CMD cmd = FindCommand(words[0]);
+    if(count != (cmd < GET ? 1 : cmd < SET ? 2 : 4)) return { ERROR };
+    if(cmd < SET) return { cmd, words[1] };
+
+    time_t TTL = 0;
+    std::from_chars(words[3].data(), words[3].data() + words[3].size(), TTL);
+    if(TTL <= 0 || TTL > MAX_TTL / (cmd == SET ? 1000 : 1)) return { ERROR };
+
+    return { cmd, words[1], words[2], TTL };
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Open addressing hash table laid out like a swiss table: one control byte per slot
+// (empty / deleted / 7 bits of the hash) stored apart from the slots, probed 16 at a time.
+// A lookup touches one control group and, most of the time, exactly one slot.
+template<class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<K>>
+class FlatIndex {
+public:
+    using value_type = std::pair<K, V>;
+
+private:
+    static constexpr size_t GROUP = 16;
+    static constexpr int8_t EMPTY = -128;   // 0b10000000
+    static constexpr int8_t DELETED = -2;   // 0b11111110
+
+    int8_t *ctrl = nullptr;
+    value_type *slots = nullptr;
+    size_t capacity = 0, count = 0, growthLeft = 0;
+
+    static size_t Mix(size_t h) {
+        // std::hash is the identity for integers, spread the bits before splitting H1 / H2
+        uint64_t x = h;
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    template<class Q>
+    static size_t HashOf(const Q &key) { return Mix(Hash{}(key)); }
+    static size_t H1(size_t hash) { return hash >> 7; }
+    static int8_t H2(size_t hash) { return hash & 0x7F; }
+
+    // bit i of the mask is set if control byte i of the group matches
+    struct Group {
+#ifdef __SSE2__
+        __m128i bytes;
+        explicit Group(const int8_t *pos) : bytes(_mm_loadu_si128((const __m128i *)pos)) {}
+        uint32_t Match(int8_t h2) const {
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(h2)));
+        }
+        uint32_t MatchEmpty() const { return Match(EMPTY); }
+        uint32_t MatchFree() const {
+            // empty and deleted are the only control bytes below -1
+            return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), bytes));
+        }
+#else
+        int8_t bytes[GROUP];
+        explicit Group(const int8_t *pos) { memcpy(bytes, pos, GROUP); }
+        uint32_t Match(int8_t h2) const {
+            uint32_t mask = 0;
+            for(size_t i = 0; i < GROUP; i ++)
+                if(bytes[i] == h2) mask |= 1u << i;
+            return mask;
+        }
+        uint32_t MatchEmpty() const { return Match(EMPTY); }
+        uint32_t MatchFree() const {
+            uint32_t mask = 0;
+            for(size_t i = 0; i < GROUP; i ++)
+                if(bytes[i] < -1) mask |= 1u << i;
+            return mask;
+        }
+#endif
+    };
+
+    // triangular probing over groups, visits every group once when capacity is a power of two
+    struct Probe {
+        size_t mask, offset, index = 0;
+        Probe(size_t hash, size_t mask) : mask(mask), offset(H1(hash) & mask) {}
+        size_t Offset(size_t i) const { return (offset + i) & mask; }
+        void Next() {
+            index += GROUP;
+            offset = (offset + index) & mask;
+        }
+    };
+
+    static size_t MaxLoad(size_t cap) { return cap - cap / 8; }
+
+    void SetCtrl(size_t i, int8_t h) {
+        ctrl[i] = h;
+        // the first GROUP - 1 bytes are mirrored past the end so unaligned group loads never wrap
+        if(i < GROUP - 1) ctrl[capacity + i] = h;
+    }
+
+    template<class Q>
+    size_t FindIndex(const Q &key, size_t hash) const {
+        if(capacity == 0) return capacity;
+        Probe seq(hash, capacity - 1);
+        while(true) {
+            Group g(ctrl + seq.offset);
+            for(uint32_t m = g.Match(H2(hash)); m; m &= m - 1) {
+                size_t i = seq.Offset(__builtin_ctz(m));
+                if(Eq{}(slots[i].first, key)) return i;
+            }
+            if(g.MatchEmpty()) return capacity;
+            seq.Next();
+        }
+    }
+
+    size_t FindFree(size_t hash) const {
+        Probe seq(hash, capacity - 1);
+        while(true) {
+            uint32_t m = Group(ctrl + seq.offset).MatchFree();
+            if(m) return seq.Offset(__builtin_ctz(m));
+            seq.Next();
+        }
+    }
+
+    void Allocate(size_t cap) {
+        capacity = cap;
+        ctrl = static_cast<int8_t *>(::operator new(cap + GROUP));
+        memset(ctrl, EMPTY, cap + GROUP);
+        slots = static_cast<value_type *>(::operator new(cap * sizeof(value_type), std::align_val_t(alignof(value_type))));
+        growthLeft = MaxLoad(cap) - count;
+    }
+
+    void Release() {
+        if(!ctrl) return;
+        for(size_t i = 0; i < capacity; i ++)
+            if(ctrl[i] >= 0) slots[i].~value_type();
+        ::operator delete(ctrl);
+        ::operator delete(slots, std::align_val_t(alignof(value_type)));
+        ctrl = nullptr;
+        slots = nullptr;
+        capacity = count = growthLeft = 0;
+    }
+
+    void Rehash(size_t cap) {
+        int8_t *oldCtrl = ctrl;
+        value_type *oldSlots = slots;
+        size_t oldCapacity = capacity;
+
+        Allocate(cap);
+        for(size_t i = 0; i < oldCapacity; i ++) {
+            if(oldCtrl[i] < 0) continue;
+            size_t hash = HashOf(oldSlots[i].first);
+            size_t j = FindFree(hash);
+            SetCtrl(j, H2(hash));
+            new(slots + j) value_type(std::move(oldSlots[i]));
+            oldSlots[i].~value_type();
+        }
+
+        if(oldCtrl) {
+            ::operator delete(oldCtrl);
+            ::operator delete(oldSlots, std::align_val_t(alignof(value_type)));
+        }
+    }
+
+    // returns the slot index for key, inserting a default constructed value if absent
+    template<class Q>
+    std::pair<size_t, bool> FindOrPrepare(Q &&key) {
+        size_t hash = HashOf(key);
+        size_t i = FindIndex(key, hash);
+        if(i != capacity) return { i, false };
+
+        if(capacity == 0) Rehash(GROUP);
+        i = FindFree(hash);
+        if(growthLeft == 0 && ctrl[i] == EMPTY) {
+            // out of room: grow, or just drop the tombstones if they are what fills the table
+            Rehash(count >= MaxLoad(capacity) / 2 ? capacity * 2 : capacity);
+            i = FindFree(hash);
+        }
+
+        if(ctrl[i] == EMPTY) growthLeft --;
+        SetCtrl(i, H2(hash));
+        new(slots + i) value_type(std::piecewise_construct, std::forward_as_tuple(std::forward<Q>(key)), std::forward_as_tuple());
+        count ++;
+        return { i, true };
+    }
+
+public:
+    template<bool Const>
+    class Iterator {
+        friend class FlatIndex;
+        using Table = std::conditional_t<Const, const FlatIndex, FlatIndex>;
+        Table *table;
+        size_t i;
+
+        void Skip() {
+            while(i < table->capacity && table->ctrl[i] < 0) i ++;
+        }
+
+    public:
+        Iterator(Table *table, size_t i) : table(table), i(i) { Skip(); }
+
+        using reference = std::conditional_t<Const, const value_type &, value_type &>;
+        using pointer = std::conditional_t<Const, const value_type *, value_type *>;
+
+        reference operator *() const { return table->slots[i]; }
+        pointer operator ->() const { return table->slots + i; }
+        Iterator &operator ++() {
+            i ++;
+            Skip();
+            return *this;
+        }
+        bool operator ==(const Iterator &other) const { return i == other.i; }
+        bool operator !=(const Iterator &other) const { return i != other.i; }
+        operator Iterator<true>() const { return { table, i }; }
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    FlatIndex() = default;
+
+    FlatIndex(const FlatIndex &other) {
+        if(other.capacity == 0) return;
+        count = other.count;
+        Allocate(other.capacity);
+        growthLeft = other.growthLeft;
+        memcpy(ctrl, other.ctrl, capacity + GROUP);
+        for(size_t i = 0; i < capacity; i ++)
+            if(ctrl[i] >= 0) new(slots + i) value_type(other.slots[i]);
+    }
+
+    FlatIndex(FlatIndex &&other) noexcept { Swap(other); }
+
+    FlatIndex &operator =(FlatIndex other) noexcept {
+        Swap(other);
+        return *this;
+    }
+
+    ~FlatIndex() { Release(); }
+
+    void Swap(FlatIndex &other) noexcept {
+        std::swap(ctrl, other.ctrl);
+        std::swap(slots, other.slots);
+        std::swap(capacity, other.capacity);
+        std::swap(count, other.count);
+        std::swap(growthLeft, other.growthLeft);
+    }
+
+    iterator begin() { return { this, 0 }; }
+    iterator end() { return { this, capacity }; }
+    const_iterator begin() const { return { this, 0 }; }
+    const_iterator end() const { return { this, capacity }; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void clear() {
+        Release();
+    }
+
+    void reserve(size_t n) {
+        size_t cap = GROUP;
+        while(MaxLoad(cap) < n) cap *= 2;
+        if(cap > capacity) Rehash(cap);
+    }
+
+    template<class Q>
+    iterator find(const Q &key) { return { this, FindIndex(key, HashOf(key)) }; }
+    template<class Q>
+    const_iterator find(const Q &key) const { return { this, FindIndex(key, HashOf(key)) }; }
+
+    template<class Q>
+    bool contains(const Q &key) const { return FindIndex(key, HashOf(key)) != capacity; }
+
+    // the slot array may be reallocated by the insert, index it only afterwards
+    V &operator [](const K &key) {
+        size_t i = FindOrPrepare(key).first;
+        return slots[i].second;
+    }
+    V &operator [](K &&key) {
+        size_t i = FindOrPrepare(std::move(key)).first;
+        return slots[i].second;
+    }
+
+    template<class Q, class M>
+    std::pair<iterator, bool> insert_or_assign(Q &&key, M &&value) {
+        auto [i, inserted] = FindOrPrepare(std::forward<Q>(key));
+        slots[i].second = std::forward<M>(value);
+        return { iterator(this, i), inserted };
+    }
+
+    void erase(iterator it) {
+        slots[it.i].~value_type();
+        SetCtrl(it.i, DELETED);
+        count --;
+    }
+
+    template<class Q>
+    size_t erase(const Q &key) {
+        size_t i = FindIndex(key, HashOf(key));
+        if(i == capacity) return 0;
+        erase(iterator(this, i));
+        return 1;
+    }
+};
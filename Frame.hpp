@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Every message between a client and the hub is a frame: a 4 byte size followed by that many
+// bytes. A read can return part of a frame or several of them, so readers collect the bytes in a
+// FrameBuffer and take whole frames out of it.
+
+inline bool ReadFully(int fd, void *data, size_t size) {
+    for(size_t done = 0; done < size; ) {
+        ssize_t bytes = read(fd, (char *)data + done, size - done);
+        if(bytes <= 0) return false;
+        done += bytes;
+    }
+    return true;
+}
+
+inline bool WriteFully(int fd, const void *data, size_t size) {
+    for(size_t done = 0; done < size; ) {
+        ssize_t bytes = write(fd, (const char *)data + done, size - done);
+        if(bytes <= 0) return false;
+        done += bytes;
+    }
+    return true;
+}
+
+inline std::string Framed(const std::string &payload) {
+    uint32_t size = payload.size();
+    std::string frame((const char *)&size, sizeof(size));
+    return frame.append(payload);
+}
+
+// one write, so frames from different threads never interleave as long as each has its own call
+inline bool WriteFrame(int fd, const std::string &payload) {
+    std::string frame = Framed(payload);
+    return WriteFully(fd, frame.data(), frame.size());
+}
+
+// a frame carrying up to MAX_PASSED descriptors, which a unix socket hands to the other process
+// along with the frame's first byte
+constexpr size_t MAX_PASSED = 4;
+
+inline bool WriteFrame(int fd, const std::string &payload, const int *fds, size_t count) {
+    std::string frame = Framed(payload);
+    iovec io = { &frame[0], frame.size() };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_PASSED)] = {};
+
+    msghdr message = {};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+
+    ssize_t bytes = sendmsg(fd, &message, 0);
+    if(bytes <= 0) return false;
+    return WriteFully(fd, frame.data() + bytes, frame.size() - bytes);
+}
+
+// blocks for one whole frame, false once the connection is gone
+inline bool ReadFrame(int fd, std::string &payload) {
+    uint32_t size;
+    if(!ReadFully(fd, &size, sizeof(size))) return false;
+
+    payload.resize(size);
+    return ReadFully(fd, &payload[0], size);
+}
+
+class FrameBuffer {
+    std::string data;
+    size_t start = 0;   // first byte not taken out yet
+
+public:
+    void Append(const char *bytes, size_t size) {
+        // drop what was taken out before growing, it is never looked at again
+        if(start > 0 && start >= data.size() / 2) {
+            data.erase(0, start);
+            start = 0;
+        }
+        data.append(bytes, size);
+    }
+
+    // one read of whatever the socket has, returns what read returned
+    ssize_t Read(int fd) {
+        char chunk[1 << 16];
+        ssize_t bytes = read(fd, chunk, sizeof(chunk));
+        if(bytes > 0) Append(chunk, bytes);
+        return bytes;
+    }
+
+    // the same, keeping the descriptors that come along (WriteFrame with fds) in passed
+    ssize_t Read(int fd, std::vector<int> &passed) {
+        char chunk[1 << 16];
+        iovec io = { chunk, sizeof(chunk) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_PASSED)] = {};
+
+        msghdr message = {};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        // control is only filled in when something was read
+        ssize_t bytes = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+        if(bytes <= 0) return bytes;
+
+        for(cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+            if(header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+                for(size_t i = 0; i < (header->cmsg_len - CMSG_LEN(0)) / sizeof(int); i ++) {
+                    int passedfd;
+                    memcpy(&passedfd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+                    passed.push_back(passedfd);
+                }
+
+        Append(chunk, bytes);
+        return bytes;
+    }
+
+    // takes out the next whole frame, false if it hasn't all arrived yet
+    bool Next(std::string &payload) {
+        uint32_t size;
+        if(data.size() - start < sizeof(size)) return false;
+        memcpy(&size, &data[start], sizeof(size));
+        if(data.size() - start - sizeof(size) < size) return false;
+
+        payload.assign(data, start + sizeof(size), size);
+        start += sizeof(size) + size;
+        return true;
+    }
+
+    // takes out every byte left, whole frames or not
+    std::string Rest() {
+        std::string rest = data.substr(start);
+        data.clear();
+        start = 0;
+        return rest;
+    }
+};
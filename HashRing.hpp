@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Consistent hash ring. Every node is placed at VNODES points around it and a key belongs to the
+// first replication distinct nodes clockwise from the key's own point, so a node joining or
+// leaving only moves the keys next to its points. Hashing is the same in every process: the hub
+// and the clients agree on who owns a key as long as they agree on the members.
+class HashRing {
+public:
+    static constexpr int VNODES = 64;
+
+private:
+    size_t replication;
+    std::vector<std::pair<uint64_t, int>> points;   // sorted by position
+    std::vector<int> members;
+
+    static uint64_t Mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // FNV-1a, mixed since short keys leave its high bits alike
+    static uint64_t Position(std::string_view key) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for(unsigned char c : key)
+            hash = (hash ^ c) * 0x100000001b3ULL;
+        return Mix(hash);
+    }
+
+    static uint64_t Position(int node, int vnode) {
+        return Mix((uint64_t)(uint32_t)node << 32 | (uint32_t)vnode);
+    }
+
+public:
+    explicit HashRing(size_t replication = 0) : replication(replication) {}
+
+    size_t Replication() const { return replication; }
+    const std::vector<int> &Members() const { return members; }
+
+    bool Contains(int node) const {
+        return std::find(members.begin(), members.end(), node) != members.end();
+    }
+
+    void Add(int node) {
+        if(Contains(node)) return;
+        members.push_back(node);
+        for(int vnode = 0; vnode < VNODES; vnode ++)
+            points.push_back({ Position(node, vnode), node });
+        std::sort(points.begin(), points.end());
+    }
+
+    void Remove(int node) {
+        members.erase(std::remove(members.begin(), members.end(), node), members.end());
+        points.erase(std::remove_if(points.begin(), points.end(), [&](auto &point) { return point.second == node; }), points.end());
+    }
+
+    // the nodes holding key, the first one answers for it
+    std::vector<int> Owners(std::string_view key) const {
+        std::vector<int> owners;
+        if(points.empty()) return owners;
+
+        size_t count = std::min(replication, members.size());
+        auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(Position(key), -1));
+        for(size_t seen = 0; owners.size() < count && seen < points.size(); seen ++, it ++) {
+            if(it == points.end()) it = points.begin();
+            if(std::find(owners.begin(), owners.end(), it->second) == owners.end())
+                owners.push_back(it->second);
+        }
+        return owners;
+    }
+
+    bool Owns(int node, std::string_view key) const {
+        auto owners = Owners(key);
+        return std::find(owners.begin(), owners.end(), node) != owners.end();
+    }
+};
@@ -0,0 +1,822 @@
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "BufferQueue.hpp"
+#include "Frame.hpp"
+#include "HashRing.hpp"
+#include "Inbox.hpp"
+#include "ShmRing.hpp"
+
+#ifndef LOGMSG
+#define LOGMSG(format, ...) fprintf(LOG, format, ##__VA_ARGS__)
+#endif
+
+// The server every client connects to, over TCP or a unix socket. Messages from a client are broadcast to every other one,
+// a SYNC request is handed to one other client, which streams its answer back on a connection of
+// its own that the hub relays to the requester. Messages are frames (Frame.hpp), reassembled per
+// connection from however the bytes arrive.
+//
+// The hub runs one event loop per thread. The first one also accepts, and hands every new client
+// to the loops in turn; from then on a client is served by its loop alone. Loops reach each other
+// through lock-free inboxes (Inbox.hpp) and wake each other with an eventfd: a broadcast read by
+// one loop is passed to its own clients and posted to the others, which pass it to theirs. A SYNC
+// stream is handed to the loop its receiver lives in, so it is relayed without crossing threads.
+//
+// Sockets are non-blocking and every loop watches its own with an edge-triggered epoll instance,
+// so an event costs the same however many clients are connected. Every ready socket is drained
+// until it would block; what a client's socket doesn't take right away waits in its connection's
+// queue until epoll says it is writable again. A broadcast is framed once and shared by every
+// queue it goes to (BufferQueue.hpp), in every loop; its bytes are copied only by the writev that
+// sends them. Queues are flushed once per read rather than once per message, so a burst of
+// messages reaches each client in a single writev.
+//
+// Queues are bounded. A broadcast that would take a client past the limit is dropped, gets the
+// client disconnected (it reconnects and resyncs) or stops the hub reading from the other clients
+// until the queue is back to half the limit, depending on the policy. SYNC streams and replies to
+// a client are always queued, a stream with pieces missing is of no use. Nothing else goes out to
+// a client in the middle of its stream: whatever is meant for it is held until the stream ends,
+// and it isn't picked to answer a SYNC meanwhile.
+//
+// The hub may keep a replica of its own: a store in the hub's process that connects like a client
+// from the address given to Replica(). It isn't counted as a client and gets every broadcast
+// whatever the policy. Once it says READY it answers every SYNC, so joining clients load from the
+// hub rather than from a peer.
+//
+// Given a replication factor the hub partitions the keyspace instead of broadcasting it. Clients
+// that say HELLO join a consistent hash ring (HashRing.hpp) and a command on a key only goes to
+// the members that own the key. Every member is sent the ring whenever it changes, so each one
+// can tell its keys from those to ASK an owner about, and hand keys it holds to their new owners.
+// Commands on the whole store are still broadcast.
+//
+// A client on a unix socket may write to the hub through shared memory instead (ShmRing.hpp). Its
+// RING message passes the ring and the eventfds that wake either end, and all it sends after that
+// goes through the ring. Its socket still carries what the hub sends it, and
+// tells when it is gone.
+class Hub {
+public:
+    enum Policy { DROP, DISCONNECT, BACKPRESSURE };
+
+    static constexpr size_t QUEUE_LIMIT = 1 << 22;
+
+private:
+    struct Connection {
+        int fd;
+        int streamTo = -1;          // carries a SYNC stream to that client
+        bool receiving = false;     // a SYNC stream to this client is in flight
+        bool congested = false;     // queued past the limit and not back to half of it yet
+        bool full = false;          // the same, counting a SYNC stream on its way to the client
+        bool stalled = false;       // input left unread until some congestion clears
+        bool doomed = false;        // closed once the current event is handled
+        bool unflushed = false;     // queued to since the last FlushQueued
+        bool replica = false;       // the hub's own store
+        FrameBuffer in;
+        std::unique_ptr<ShmRing> ring;  // where the client writes to us, once it sent RING
+        std::vector<int> passed;    // descriptors that came with its messages, for RING to take
+        BufferQueue out;            // accepted for the client, not yet taken by its socket
+        BufferQueue held;           // queued while receiving, sent once the stream is over
+
+        size_t peak = 0, dropped = 0;
+        uint64_t sent = 0;
+        uint64_t streamEnd = 0;     // sent once the client has all of its SYNC stream so far
+    };
+
+    class Loop;
+
+    // what one loop posts another: fd is the sender of a BROADCAST, the recipient of a DIRECT, the
+    // requester of METRICS, whose answer goes back to from, and the client whose SYNC a REFUSE fails
+    struct Mail {
+        enum Kind { BROADCAST, DIRECT, ADOPT, RESUME, METRICS, REFUSE } kind;
+        int fd = -1;
+        BufferQueue::Buffer data = nullptr;
+        std::unique_ptr<Connection> conn = nullptr;
+        Loop *from = nullptr;
+    };
+
+    class Loop {
+        Hub &hub;
+        FILE *LOG;
+        int index, epollfd, wakefd;
+        Inbox<Mail> inbox;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+        std::unordered_map<int, int> rings;     // a ring's Wakeup -> the client writing to it
+        bool drained = false;   // some congestion cleared since the stalled connections were resumed
+        std::vector<int> stalled, doomed, unflushed;
+        char chunk[1 << 16];
+
+        Connection *Find(int fd) {
+            auto it = connections.find(fd);
+            return it != connections.end() ? it->second.get() : nullptr;
+        }
+
+        // what the slow consumer policy goes by; a SYNC stream has to get through whole, so what
+        // of it is still queued doesn't count
+        static size_t Depth(const Connection &conn) {
+            size_t streamed = conn.streamEnd > conn.sent ? conn.streamEnd - conn.sent : 0;
+            return conn.out.Size() - streamed + conn.held.Size();
+        }
+
+        bool Paused() const {
+            return hub.policy == BACKPRESSURE && hub.congested > 0;
+        }
+
+        // a congested client is still read from, it may be stuck writing to us rather than reading
+        bool Paused(const Connection &conn) const {
+            return Paused() && !conn.congested;
+        }
+
+        void Drained() {
+            drained = true;
+            if(hub.policy != BACKPRESSURE) return;
+
+            // the other loops may have stalled clients waiting on this one
+            for(auto &loop : hub.loops)
+                if(loop.get() != this) loop->Post({ Mail::RESUME });
+        }
+
+        void Update(Connection &conn) {
+            // the stream relayed to the client waits for everything queued before it to drain
+            if(!conn.full && conn.out.Size() > hub.limit) conn.full = true;
+            else if(conn.full && conn.out.Size() <= hub.limit / 2) {
+                conn.full = false;
+                drained = true;
+            }
+
+            size_t depth = Depth(conn);
+            conn.peak = std::max(conn.peak, depth);
+
+            if(!conn.congested && depth > hub.limit) {
+                conn.congested = true;
+                hub.congested ++;
+            } else if(conn.congested && depth <= hub.limit / 2) {
+                conn.congested = false;
+                hub.congested --;
+                Drained();
+            }
+        }
+
+        void Flush(Connection &conn) {
+            while(!conn.out.Empty()) {
+                ssize_t bytes = conn.out.WriteTo(conn.fd);
+                if(bytes <= 0) break;
+                conn.sent += bytes;
+            }
+            Update(conn);
+        }
+
+        // queued whatever the policy and sent on the next FlushQueued; a failed write shows up as
+        // a disconnect on the next read. Relay writes a SYNC stream straight to out, anything else
+        // would land in the middle of it
+        void Queue(Connection &conn, BufferQueue::Buffer data) {
+            if(conn.receiving) {
+                conn.held.Push(std::move(data));
+                return Update(conn);
+            }
+
+            conn.out.Push(std::move(data));
+            if(!conn.unflushed) {
+                conn.unflushed = true;
+                unflushed.push_back(conn.fd);
+            }
+        }
+
+        void FlushQueued() {
+            for(int fd : std::exchange(unflushed, {}))
+                if(Connection *conn = Find(fd)) {
+                    conn->unflushed = false;
+                    Flush(*conn);
+                }
+        }
+
+        // queued to the client fd, whichever loop it lives in
+        void Deliver(Loop *loop, int fd, BufferQueue::Buffer data) {
+            if(loop != this) return loop->Post({ Mail::DIRECT, fd, std::move(data) });
+            if(Connection *conn = Find(fd)) Queue(*conn, std::move(data));
+        }
+
+        // a broadcast, subject to the slow consumer policy
+        void Send(Connection &conn, const BufferQueue::Buffer &frame) {
+            // only what the client's socket refused counts against it, not what we haven't offered yet
+            if(conn.unflushed && Depth(conn) + frame->size() > hub.limit) Flush(conn);
+
+            size_t depth = Depth(conn);
+            if(depth > 0 && depth + frame->size() > hub.limit && !conn.replica) {
+                if(hub.policy == DROP) {
+                    conn.dropped ++;
+                    return;
+                }
+                if(hub.policy == DISCONNECT) return Doom(conn);
+            }
+
+            Queue(conn, frame);
+        }
+
+        // to every client of this loop but the sender
+        void Broadcast(int from, const BufferQueue::Buffer &frame) {
+            for(auto &[fd, other] : connections)
+                if(fd != from && other->streamTo == -1 && !other->doomed)
+                    Send(*other, frame);
+        }
+
+        // closing now would pull the connection out from under whoever is iterating over them
+        void Doom(Connection &conn) {
+            if(conn.doomed) return;
+            LOGMSG("[ slow consumer ] Disconnecting fd #%d with %zu bytes queued\n", conn.fd, Depth(conn));
+            conn.doomed = true;
+            doomed.push_back(conn.fd);
+            if(hub.Forget(conn.fd)) Announce();
+        }
+
+        void Stall(Connection &conn) {
+            if(conn.stalled) return;
+            conn.stalled = true;
+            stalled.push_back(conn.fd);
+        }
+
+        void Close(Connection &conn) {
+            LOGMSG("[ connection ] Client disconnected with fd #%d\n", conn.fd);
+            if(conn.streamTo == -1) {
+                if(!conn.replica) hub.clients --;
+                if(hub.Forget(conn.fd)) Announce();
+                for(auto &[requester, loop] : hub.Abandon(conn.fd))
+                    if(loop != this) loop->Post({ Mail::REFUSE, requester });
+                    else if(Connection *other = Find(requester)) Answer(*other, false);
+            }
+            if(conn.congested) {
+                hub.congested --;
+                Drained();
+            }
+            bool replica = conn.replica;
+            if(conn.ring) rings.erase(conn.ring->Wakeup());
+            for(int fd : conn.passed)
+                close(fd);
+            close(conn.fd);
+            connections.erase(conn.fd);
+
+            // the last one out stops every loop
+            if(!replica && -- hub.open == 0)
+                for(auto &loop : hub.loops) loop->Wake();
+        }
+
+        // closes the doomed connections and goes back to the input left unread, until neither
+        // changes anything; edge-triggered epoll won't report that input again
+        void Sweep() {
+            while(!doomed.empty() || drained) {
+                for(int fd : std::exchange(doomed, {}))
+                    if(Connection *conn = Find(fd)) Close(*conn);
+
+                if(!drained) continue;
+                drained = false;
+                for(int fd : std::exchange(stalled, {}))
+                    if(Connection *conn = Find(fd)) {
+                        conn->stalled = false;
+                        Readable(*conn);
+                    }
+            }
+        }
+
+        void Accept() {
+            while(true) {
+                sockaddr_storage clientAddr;
+                socklen_t clientAddrLen = sizeof(clientAddr);
+                int clientfd = accept(hub.listenfd, (sockaddr *)&clientAddr, &clientAddrLen);
+                if(clientfd == -1) return;
+
+                NonBlocking(clientfd);
+                auto conn = std::make_unique<Connection>();
+                conn->fd = clientfd;
+                conn->replica = hub.replicaAddrLen > 0 && clientAddrLen == hub.replicaAddrLen && memcmp(&clientAddr, &hub.replicaAddr, clientAddrLen) == 0;
+
+                Loop *loop = hub.loops[hub.nextLoop ++ % hub.loops.size()].get();
+                if(!conn->replica) {
+                    hub.open ++;
+                    hub.clients ++;
+                    hub.served = true;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(hub.directoryMtx);
+                    hub.directory[clientfd] = loop;
+                    if(conn->replica) hub.replica = clientfd;
+                }
+
+                LOGMSG("[ connection ] New client with fd #%d from %s in loop #%d\n", clientfd, Name(clientAddr).c_str(), loop->index);
+                if(loop == this) Adopt(std::move(conn));
+                else loop->Post({ Mail::ADOPT, clientfd, nullptr, std::move(conn) });
+            }
+        }
+
+        void Adopt(std::unique_ptr<Connection> conn) {
+            int fd = conn->fd;
+            epoll_event event = { EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, { .fd = fd } };
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+
+            Connection &adopted = *(connections[fd] = std::move(conn));
+            Flush(adopted);
+            if(adopted.streamTo != -1) Stream(adopted);
+            else Readable(adopted);
+        }
+
+        // the connection and whatever it has buffered move to loop
+        void Handoff(Connection &conn, Loop *loop) {
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+
+            Mail mail { Mail::ADOPT, conn.fd };
+            mail.conn = std::move(connections[conn.fd]);
+            connections.erase(mail.fd);
+            loop->Post(std::move(mail));
+        }
+
+        // past its header a stream connection is relayed by the loop its receiver lives in, as it
+        // comes
+        void Stream(Connection &stream) {
+            Loop *owner = hub.Owner(stream.streamTo);
+            if(owner && owner != this) return Handoff(stream, owner);
+
+            // a request that was failed meanwhile gets no stream
+            Connection *target = Find(stream.streamTo);
+            if(!target || !hub.Claim(stream.streamTo)) return Close(stream);
+
+            Answer(*target, true);
+            Pass(*target, Share(stream.in.Rest()));
+            Relay(stream);
+        }
+
+        // tells a client whether a SYNC stream follows; one that doesn't come lets out what was
+        // held for it
+        void Answer(Connection &conn, bool streamed) {
+            conn.out.Push(Share(Framed(std::string(1, streamed))));
+            if(!streamed) {
+                conn.receiving = false;
+                conn.out.Append(conn.held);
+            }
+            Flush(conn);
+        }
+
+        // a piece of a SYNC stream goes straight to out, past Queue and the policy
+        void Pass(Connection &target, BufferQueue::Buffer data) {
+            target.out.Push(std::move(data));
+            target.streamEnd = target.sent + target.out.Size();
+            Flush(target);
+        }
+
+        // a SYNC stream is passed on in whatever pieces it arrives, and no faster than its
+        // receiver takes it
+        void Relay(Connection &stream) {
+            while(true) {
+                Connection *target = Find(stream.streamTo);
+                if(target && target->full) return Stall(stream);
+
+                ssize_t bytes = read(stream.fd, chunk, sizeof(chunk));
+                if(bytes < 0 && errno == EAGAIN) return;
+
+                if(bytes > 0) {
+                    if(target) Pass(*target, Share(std::string(chunk, bytes)));
+                    continue;
+                }
+
+                LOGMSG("[ sync ] Stream #%d to fd #%d is over\n", stream.fd, stream.streamTo);
+                hub.Synced(stream.streamTo);
+                if(target) {
+                    target->receiving = false;
+                    target->out.Append(target->held);
+                    Flush(*target);
+                }
+                return Close(stream);
+            }
+        }
+
+        // every ring member is sent the ring as it is now, along with its own place in it
+        void Announce() {
+            std::vector<std::pair<int, Loop *>> members;
+            std::string ring;
+            {
+                std::lock_guard<std::mutex> lock(hub.directoryMtx);
+                for(int member : hub.ring.Members()) {
+                    members.push_back({ member, hub.directory[member] });
+                    ring += " " + std::to_string(member);
+                }
+            }
+            LOGMSG("[ ring ] %zu members:%s\n", members.size(), ring.c_str());
+
+            ring = " " + std::to_string(hub.replication) + ring;
+            for(auto &[member, loop] : members)
+                Deliver(loop, member, Share(Framed("RING " + std::to_string(member) + ring)));
+            FlushQueued();
+        }
+
+        // TO and ANSWER go to the client they name, a command on a key to the key's owners; an
+        // ASK is answered by the first owner and, unless it only reads, applied by the others too.
+        // false for what isn't routed
+        bool Route(Connection &conn, const std::string &payload) {
+            std::string_view rest = payload;
+            std::string_view word = Word(rest);
+
+            if(word == "TO" || word == "ANSWER") {
+                int fd = atoi(std::string(Word(rest)).c_str());
+                if(Loop *owner = hub.Owner(fd))
+                    Deliver(owner, fd, Share(Framed(word == "TO" ? std::string(rest) : "ANSWER " + std::string(rest))));
+                return true;
+            }
+
+            bool ask = word == "ASK";
+            std::string_view command = ask ? rest : std::string_view(payload);
+            std::string_view key = command;
+            Word(key);
+            key = Word(key);
+            if(key.empty()) return ask;
+
+            LOGMSG("[ route ] From fd #%d: %s\n", conn.fd, payload.c_str());
+            auto owners = hub.Holders(key);
+            if(ask && owners.empty()) Queue(conn, Share(Framed("ANSWER No client holds \"" + std::string(key) + "\"")));
+
+            bool read = command.substr(0, 4) == "GET ";
+            BufferQueue::Buffer frame = Share(Framed(std::string(command)));
+            for(size_t i = 0; i < owners.size(); i ++) {
+                auto [fd, loop] = owners[i];
+                if(ask && i == 0) Deliver(loop, fd, Share(Framed("ASK " + std::to_string(conn.fd) + " " + std::string(command))));
+                else if(fd != conn.fd && !read) Deliver(loop, fd, frame);
+            }
+            return true;
+        }
+
+        // the next space separated word of rest, taken off it
+        static std::string_view Word(std::string_view &rest) {
+            size_t end = std::min(rest.find(' '), rest.size());
+            std::string_view word = rest.substr(0, end);
+            rest.remove_prefix(std::min(end + 1, rest.size()));
+            return word;
+        }
+
+        std::string Metrics() {
+            char line[128];
+            std::string report = "METRICS\n";
+            snprintf(line, sizeof(line), "loop #%d\n%6s %12s %12s %14s %8s\n", index, "fd", "queued", "peak", "sent", "dropped");
+            report += line;
+
+            for(auto &[fd, conn] : connections)
+                if(conn->streamTo == -1) {
+                    snprintf(line, sizeof(line), "%6d %12zu %12zu %14lu %8zu\n", fd, Depth(*conn), conn->peak, (unsigned long)conn->sent, conn->dropped);
+                    report += line;
+                }
+            return report;
+        }
+
+        void Message(Connection &conn, const std::string &payload) {
+            if(payload.compare(0, 6, "STREAM") == 0) {
+                conn.streamTo = atoi(payload.c_str() + 7);
+                hub.clients --;
+                hub.Forget(conn.fd);
+                LOGMSG("[ sync ] Fd #%d streams to fd #%d\n", conn.fd, conn.streamTo);
+
+                return Queue(conn, Share(Framed(std::string(1, 1))));
+            }
+
+            // a client on our host writes to its ring from here on
+            if(payload == "RING") {
+                if(conn.passed.size() == 3 && (conn.ring = ShmRing::Open(conn.passed.data()))) {
+                    int wakefd = conn.ring->Wakeup();
+                    rings[wakefd] = conn.fd;
+                    epoll_event event = { EPOLLIN | EPOLLET, { .fd = wakefd } };
+                    epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event);
+                    LOGMSG("[ connection ] Fd #%d writes through shared memory\n", conn.fd);
+                } else
+                    for(int fd : conn.passed) close(fd);
+                conn.passed.clear();
+                return;
+            }
+
+            if(conn.replica && payload == "READY") {
+                LOGMSG("[ sync ] Replica #%d is ready\n", conn.fd);
+                std::lock_guard<std::mutex> lock(hub.directoryMtx);
+                hub.replicaReady = hub.replica == conn.fd;
+                return;
+            }
+
+            // in the ring if the keyspace is partitioned; either way the client is told the ring
+            if(payload == "HELLO") {
+                if(hub.Join(conn.fd)) return Announce();
+                return Queue(conn, Share(Framed("RING " + std::to_string(conn.fd) + " 0")));
+            }
+
+            if(payload.compare(0, 4, "SYNC") == 0) {
+                int syncerfd = -1;
+                Loop *syncer = hub.Syncer(conn.fd, syncerfd);
+                if(!syncer) return Queue(conn, Share(Framed(std::string(1, false))));
+
+                // the syncer answers on a new connection, tell it who the stream is for; the
+                // client hears back once the stream shows up (Stream) or the syncer leaves (Close)
+                conn.receiving = true;
+                return Deliver(syncer, syncerfd, Share(Framed(payload + " " + std::to_string(conn.fd))));
+            }
+
+            // every loop reports its own clients
+            if(payload == "METRICS") {
+                Queue(conn, Share(Framed(hub.Summary())));
+                Queue(conn, Share(Framed(Metrics())));
+                for(auto &loop : hub.loops)
+                    if(loop.get() != this) loop->Post({ Mail::METRICS, conn.fd, nullptr, nullptr, this });
+                return;
+            }
+
+            if(hub.replication > 0 && Route(conn, payload)) return;
+
+            LOGMSG("[ transmission ] From fd #%d: %s\n", conn.fd, payload.c_str());
+            BufferQueue::Buffer frame = Share(Framed(payload));
+            Broadcast(conn.fd, frame);
+            for(auto &loop : hub.loops)
+                if(loop.get() != this) loop->Post({ Mail::BROADCAST, conn.fd, frame });
+        }
+
+        void Readable(Connection &conn) {
+            if(conn.streamTo != -1) return Relay(conn);
+
+            std::string payload;
+            while(true) {
+                // unread input waits in the socket, then in the sender's
+                if(Paused(conn)) return Stall(conn);
+
+                ssize_t bytes = Receive(conn);
+                if(bytes < 0 && errno == EAGAIN) return;
+                if(bytes <= 0) return Close(conn);
+
+                while(conn.streamTo == -1 && conn.in.Next(payload))
+                    Message(conn, payload);
+                FlushQueued();
+
+                if(conn.streamTo != -1) return Stream(conn);
+            }
+        }
+
+        // from the client's ring while it has something, then from its socket
+        ssize_t Receive(Connection &conn) {
+            if(conn.ring)
+                if(size_t bytes = conn.ring->Read(chunk, sizeof(chunk))) {
+                    conn.in.Append(chunk, bytes);
+                    return bytes;
+                }
+            return conn.in.Read(conn.fd, conn.passed);
+        }
+
+        void ReadMail() {
+            uint64_t count;
+            read(wakefd, &count, sizeof(count));
+
+            for(Mail &mail : inbox.TakeAll())
+                switch(mail.kind) {
+                    case Mail::BROADCAST: Broadcast(mail.fd, mail.data); break;
+                    case Mail::DIRECT: Deliver(this, mail.fd, mail.data); break;
+                    case Mail::ADOPT: Adopt(std::move(mail.conn)); break;
+                    case Mail::RESUME: drained = true; break;
+                    case Mail::METRICS: mail.from->Post({ Mail::DIRECT, mail.fd, Share(Framed(Metrics())) }); break;
+                    case Mail::REFUSE: if(Connection *conn = Find(mail.fd)) Answer(*conn, false); break;
+                }
+            FlushQueued();
+        }
+
+    public:
+        Loop(Hub &hub, int index) : hub(hub), LOG(hub.LOG), index(index) {
+            epollfd = epoll_create1(0);
+            wakefd = eventfd(0, EFD_NONBLOCK);
+
+            epoll_event event = { EPOLLIN, { .fd = wakefd } };
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event);
+        }
+
+        ~Loop() {
+            for(auto &[fd, conn] : connections)
+                close(fd);
+            close(wakefd);
+            close(epollfd);
+        }
+
+        void Listen() {
+            epoll_event event = { EPOLLIN | EPOLLET, { .fd = hub.listenfd } };
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, hub.listenfd, &event);
+        }
+
+        void Wake() {
+            uint64_t one = 1;
+            write(wakefd, &one, sizeof(one));
+        }
+
+        void Post(Mail mail) {
+            if(inbox.Push(std::move(mail))) Wake();
+        }
+
+        void Run() {
+            epoll_event events[256];
+            while(!hub.served || hub.open > 0) {
+                int count = epoll_wait(epollfd, events, 256, -1);
+                for(int i = 0; i < count; i ++) {
+                    int fd = events[i].data.fd;
+                    if(fd == hub.listenfd) {
+                        Accept();
+                        continue;
+                    }
+                    if(fd == wakefd) {
+                        ReadMail();
+                        continue;
+                    }
+
+                    // a ring stands in for its client's socket; input left in it while stalled is
+                    // gone back to by Sweep
+                    if(auto ring = rings.find(fd); ring != rings.end()) {
+                        Connection *conn = Find(ring->second);
+                        conn->ring->Clear();
+                        if(!conn->doomed && !conn->stalled) Readable(*conn);
+                        continue;
+                    }
+
+                    Connection *conn = Find(fd);
+                    if(!conn || conn->doomed) continue;
+                    if(events[i].events & EPOLLOUT) Flush(*conn);
+                    if(!conn->stalled && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) Readable(*conn);
+                }
+                Sweep();
+            }
+        }
+    };
+
+    int listenfd;
+    FILE *LOG;
+    size_t limit;
+    Policy policy;
+    std::vector<std::unique_ptr<Loop>> loops;
+    size_t nextLoop = 0;    // the next client goes to this loop, only the first loop accepts
+
+    // the loop every client lives in, for the SYNC requests and streams that cross loops
+    std::mutex directoryMtx;
+    std::unordered_map<int, Loop *> directory;
+    std::unordered_set<int> receiving;  // clients a SYNC stream is in flight to
+    std::unordered_map<int, int> pending;   // clients waiting for a SYNC stream -> who was asked for it
+    int replica = -1;           // in the directory too
+    bool replicaReady = false;  // synced with a client, so its copy is worth handing out
+    sockaddr_storage replicaAddr {};
+    socklen_t replicaAddrLen = 0;
+    size_t replication;         // copies of every key, 0 for every key on every client
+    HashRing ring;
+
+    std::atomic<int> open { 0 };        // connections, SYNC streams included
+    std::atomic<int> clients { 0 };     // connections that aren't SYNC streams
+    std::atomic<int> congested { 0 };
+    std::atomic<bool> served { false };
+
+    static void NonBlocking(int fd) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    static std::string Name(const sockaddr_storage &address) {
+        if(address.ss_family != AF_INET) return "a local socket";
+
+        const sockaddr_in &remote = (const sockaddr_in &)address;
+        return "address " + std::string(inet_ntoa(remote.sin_addr)) + ":" + std::to_string(ntohs(remote.sin_port));
+    }
+
+    static BufferQueue::Buffer Share(std::string data) {
+        return std::make_shared<const std::string>(std::move(data));
+    }
+
+    Loop *Owner(int fd) {
+        std::lock_guard<std::mutex> lock(directoryMtx);
+        auto it = directory.find(fd);
+        return it != directory.end() ? it->second : nullptr;
+    }
+
+    // no longer a client a SYNC can go to, a stream can be for or a key can live on; true if it
+    // left the ring
+    bool Forget(int fd) {
+        std::lock_guard<std::mutex> lock(directoryMtx);
+        directory.erase(fd);
+        receiving.erase(fd);
+        pending.erase(fd);
+        if(fd == replica) {
+            replica = -1;
+            replicaReady = false;
+        }
+        if(!ring.Contains(fd)) return false;
+        ring.Remove(fd);
+        return true;
+    }
+
+    // false if the keyspace isn't partitioned
+    bool Join(int fd) {
+        std::lock_guard<std::mutex> lock(directoryMtx);
+        if(replication == 0) return false;
+        ring.Add(fd);
+        return true;
+    }
+
+    std::vector<std::pair<int, Loop *>> Holders(std::string_view key) {
+        std::lock_guard<std::mutex> lock(directoryMtx);
+        std::vector<std::pair<int, Loop *>> holders;
+        for(int fd : ring.Owners(key))
+            holders.push_back({ fd, directory[fd] });
+        return holders;
+    }
+
+    // the replica once it's ready, otherwise a client other than requester, to answer its SYNC;
+    // neither may be receiving a stream of its own. Picking one marks requester as receiving in
+    // the same step, so two clients syncing at once can't pick each other
+    Loop *Syncer(int requester, int &fd) {
+        std::lock_guard<std::mutex> lock(directoryMtx);
+        // a joining ring member gets its keys from the others as the ring changes
+        if(replication > 0) return nullptr;
+
+        fd = -1;
+        if(replicaReady && replica != requester && !receiving.count(replica)) fd = replica;
+        else
+            for(auto &[client, loop] : directory)
+                if(client != requester && client != replica && !receiving.count(client)) {
+                    fd = client;
+                    break;
+                }
+        if(fd == -1) return nullptr;
+
+        receiving.insert(requester);
+        pending[requester] = fd;
+        return directory[fd];
+    }
+
+    // the stream for requester showed up; false if its request was failed meanwhile
+    bool Claim(int requester) {
+        std::lock_guard<std::mutex> lock(directoryMtx);
+        return pending.erase(requester) > 0;
+    }
+
+    // the requests syncer was asked to answer and now never will, with the loops their requesters
+    // live in; they are no longer receiving
+    std::vector<std::pair<int, Loop *>> Abandon(int syncer) {
+        std::lock_guard<std::mutex> lock(directoryMtx);
+        std::vector<std::pair<int, Loop *>> abandoned;
+        for(auto it = pending.begin(); it != pending.end(); )
+            if(it->second == syncer) {
+                receiving.erase(it->first);
+                abandoned.push_back({ it->first, directory[it->first] });
+                it = pending.erase(it);
+            } else
+                it ++;
+        return abandoned;
+    }
+
+    void Synced(int fd) {
+        std::lock_guard<std::mutex> lock(directoryMtx);
+        receiving.erase(fd);
+    }
+
+    std::string Summary() {
+        char line[192];
+        char extra[64] = "";
+        {
+            std::lock_guard<std::mutex> lock(directoryMtx);
+            if(replicaReady) snprintf(extra, sizeof(extra), ", replica ready");
+            if(replication > 0) snprintf(extra, sizeof(extra), ", %zu in the ring, %zu copies of a key", ring.Members().size(), replication);
+        }
+        snprintf(line, sizeof(line), "METRICS\n%d clients, %d congested, limit %zu bytes, reading %s, %zu loops%s\n", clients.load(), congested.load(), limit, policy == BACKPRESSURE && congested > 0 ? "paused" : "on", loops.size(), extra);
+        return line;
+    }
+
+public:
+    Hub(int listenfd, FILE *log, size_t limit = QUEUE_LIMIT, Policy policy = DISCONNECT, size_t threads = 1, size_t replication = 0) : listenfd(listenfd), LOG(log), limit(limit), policy(policy), replication(replication), ring(replication) {
+        NonBlocking(listenfd);
+        for(size_t i = 0; i < std::max<size_t>(threads, 1); i ++)
+            loops.push_back(std::make_unique<Loop>(*this, i));
+        loops[0]->Listen();
+    }
+
+    // the replica connects from address, before Run; a TCP address, or a unix socket's own name
+    void Replica(const sockaddr *address, socklen_t len) {
+        memcpy(&replicaAddr, address, len);
+        replicaAddrLen = len;
+    }
+
+    // serves clients until the last one leaves
+    void Run() {
+        std::vector<std::thread> threads;
+        for(size_t i = 1; i < loops.size(); i ++)
+            threads.emplace_back(&Loop::Run, loops[i].get());
+        loops[0]->Run();
+
+        for(auto &thread : threads)
+            thread.join();
+    }
+};
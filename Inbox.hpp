@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// Lock-free queue with any number of producers and one consumer. Producers push onto a stack with
+// a compare and swap, the consumer takes the whole stack with one exchange and reverses it, so it
+// never races a producer for a single node. What one producer pushes comes out in its order.
+template<class T>
+class Inbox {
+    struct Node {
+        T value;
+        Node *next;
+    };
+
+    std::atomic<Node *> head { nullptr };
+
+public:
+    Inbox() = default;
+    Inbox(const Inbox &) = delete;
+    Inbox &operator=(const Inbox &) = delete;
+
+    ~Inbox() {
+        TakeAll();
+    }
+
+    // true if the inbox was empty, its consumer may be asleep and needs waking
+    bool Push(T value) {
+        // once pushed the node belongs to the consumer, only next is looked at afterwards
+        Node *next = head.load(std::memory_order_relaxed);
+        Node *node = new Node { std::move(value), next };
+        while(!head.compare_exchange_weak(next, node, std::memory_order_release, std::memory_order_relaxed))
+            node->next = next;
+        return next == nullptr;
+    }
+
+    // everything pushed so far, oldest first
+    std::vector<T> TakeAll() {
+        std::vector<T> values;
+        for(Node *node = head.exchange(nullptr, std::memory_order_acquire); node; ) {
+            values.push_back(std::move(node->value));
+            Node *next = node->next;
+            delete node;
+            node = next;
+        }
+        std::reverse(values.begin(), values.end());
+        return values;
+    }
+};
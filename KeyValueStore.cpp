@@ -1,395 +1,644 @@
 #include <arpa/inet.h>
 #include <cerrno>
+#include <poll.h>
+#include <csignal>
 #include <cstddef>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstring>
+#include <deque>
+#include <dirent.h>
 #include <cassert>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <string>
 #include <thread>
+#include <chrono>
+#include <condition_variable>
 #include <atomic>
 #include <mutex>
-#include <queue>
+#include <shared_mutex>
 #include <ctime>
 #include <map>
 #include <stack>
-#include "json.hpp"
+#include <vector>
+#include <memory>
+#include <random>
+#include "Backlog.hpp"
+#include "Command.hpp"
+#include "FlatIndex.hpp"
+#include "HashRing.hpp"
+#include "Hub.hpp"
+#include "Resp.hpp"
+#include "Server.hpp"
+#include "ShmRing.hpp"
+#include "SpillLog.hpp"
+#include "SyncStream.hpp"
+#include "TimingWheel.hpp"
 
 using namespace std;
-using json = nlohmann::json;
 
 #define LOGMSG(format, ...) fprintf(LOG, format, ##__VA_ARGS__)
 
-#define FOREACH_CMD(FUNC) \
-    FUNC(ERROR) \
-    FUNC(PUSH) \
-    FUNC(POP) \
-    FUNC(DELETESAVES) \
-    FUNC(SIZE) \
-    FUNC(PRINTALL) \
-    FUNC(GET) \
-    FUNC(DELETE) \
-    FUNC(SET)
-
-#define ENUM(CMD) CMD,
-#define NAME(CMD) #CMD,
-
-enum CMD { FOREACH_CMD(ENUM) };
-
-vector<string> CMDEnumToString = { FOREACH_CMD(NAME) };
-map<string, CMD> CMDStringToEnum = [] {
-    map<string, CMD> m;
-    for(int i = 0; i < CMDEnumToString.size(); i ++)
-        m[CMDEnumToString[i]] = CMD(i);
-    return m;
-}();
-
-struct CMDStructure {
-    CMD CMDEnum;
-    string key = "";
-    string value = "";
-    time_t TTL = 0;
-
-    string toString() {
-        return 
-            "CMD: " + CMDEnumToString[CMDEnum] + 
-            " | Key: "  + key +
-            " | Value: " + value +
-            " | TTL: " + to_string(TTL);
-    }
-
-    string Serialize() {
-        return CMDEnumToString[CMDEnum] + (key != "" ? " " + key : "") + (value != "" ? " " + value : "") + (TTL > 0 ? " " + to_string(TTL) : "");
-    }
-};
-
 struct Response {
     string value;
     bool success;
 };
 
-CMDStructure InputParser(string raw);
-
 class KeyValueStore {
 private:
+    // the deadline sits next to the value, so a read can tell an expired pair on its own
     struct Entry {
+        string value;
+        uint64_t expires;
+    };
+
+    // a key as it was before its first change since the last PUSH: cached says whether it was
+    // in memory, deadline is NEVER if it didn't exist at all
+    struct Undo {
         string key;
-        time_t deleteTime;
+        bool cached;
+        Entry entry;
+        uint64_t deadline;
+    };
 
-        // priority queue = max-heap | we reverse the the operation to make it a min-heap
-        bool operator <(const Entry &a) const {
-            return deleteTime > a.deleteTime;
-        }
+    // where a PUSH left the undo log and the size accounting
+    struct Save {
+        size_t undo;
+        int size;
     };
 
-    stack<priority_queue<Entry>> recycleBin;
+    // keys are hash-partitioned over the shards, each shard owns its cache, size accounting,
+    // persistent storage, recycle bin and undo log and is guarded by its own mutex
+    struct Shard {
+        int id, sizeLimit, size = 0;
+        FlatIndex<string, Entry, hash<string_view>, equal_to<>> cache;   // looked up by string_view too
+        ExpiryIndex<string> recycleBin;
+        vector<Save> saves;
+        vector<Undo> undo;
+        FlatIndex<string, bool> touched;    // keys logged since the last PUSH
+        unique_ptr<SpillLog> spill;
+        shared_mutex mtx;
+    };
+
+    vector<unique_ptr<Shard>> shards;
     thread recyclerThread;
     atomic<bool> recycling;
 
+    // the recycler sleeps until nextWake, a SET due before that wakes it up
+    mutex recyclerMtx;
+    condition_variable recyclerCv;
+    atomic<uint64_t> nextWake;
+
+    // most keys the recycler expires per shard before letting the clients back in
+    static constexpr size_t EXPIRE_BATCH = 256;
+
+public:
+    // bytes of recent mutations kept for incremental SYNC, unless .config says otherwise
+    static constexpr size_t BACKLOG_SIZE = 1 << 20;
+
+    // bytes the hub hasn't read yet before UseRing's writes wait
+    static constexpr size_t RING_SIZE = 1 << 20;
+
+private:
+
     ostream *notificationStream;
     char timeString[20];
 
     int sizeLimit, socketfd;
-    stack<int> size;
     FILE *LOG;
 
-    stack<map<string,string>> cacheSaves;
-    #define cache cacheSaves.top()
+    mutex socketMtx;
+    unique_ptr<ShmRing> channel;    // the hub reads what we send from here, once UseRing set it up
+
+    // position in the history of mutations this store shares with the peers it synced with;
+    // a store starts a history of its own and adopts a peer's on a full SYNC. A store no hub can
+    // SYNC from, as in server mode, keeps no backlog
+    uint64_t replId;
+    bool logging;
+    Backlog backlog;
+    bool fullSync = false;      // a SYNC stream being loaded started with RESET
+    deque<string> applied;      // mutations from the hub applied while our SYNC request was on its way
+
+    // the hub's ring when the keyspace is partitioned and this client's place in it; only the
+    // thread talking to the hub uses them
+    HashRing ring;
+    int self = -1;
+
+    // forked SYNC senders that may still be running; their snapshots read the persistent storage
+    // files, so POP leaves those alone until they're done. Only used under every shard lock
+    vector<pid_t> senders;
+
+    // waits for the senders that are done, without blocking; how many are left
+    size_t Reap() {
+        senders.erase(remove_if(senders.begin(), senders.end(), [](pid_t pid) { return waitpid(pid, nullptr, WNOHANG) != 0; }), senders.end());
+        return senders.size();
+    }
+
+    // to the hub, through the ring if there is one; under socketMtx
+    bool Write(const string &payload) {
+        if(!channel) return WriteFrame(socketfd, payload);
+
+        string frame = Framed(payload);
+        return channel->WriteAll(frame.data(), frame.size(), socketfd);
+    }
+
+    Shard &ShardOf(string_view key) {
+        return *shards[hash<string_view>{}(key) % shards.size()];
+    }
+
+    // whole-store commands take every shard lock, always in the same order
+    vector<unique_lock<shared_mutex>> LockAll() {
+        vector<unique_lock<shared_mutex>> locks;
+        for(auto &shard : shards)
+            locks.emplace_back(shard->mtx);
+        return locks;
+    }
+
+    void WakeRecycler(uint64_t deadline) {
+        if(deadline >= nextWake) return;
 
-    mutex mtx;
+        lock_guard<mutex> lock(recyclerMtx);
+        if(deadline < nextWake) {
+            nextWake = deadline;
+            recyclerCv.notify_one();
+        }
+    }
+
+    // the pid keeps apart stores started in the same second, the hub's replica and its first client
+    string StoragePath(const Shard &shard) {
+        return "./temp/" + to_string(shard.id) + "-" + to_string(getpid()) + "-" + string(timeString) + ".log";
+    }
+
+    // milliseconds on the monotonic clock, deadlines and the recycler's wheels count in these
+    static uint64_t Now() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-    Response Set(string key, string value, time_t TTL) {
+    // milliseconds on the wall clock, deadlines cross to other processes in these
+    static uint64_t WallNow() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // logs how the key looked before its first change since the last PUSH, POP replays it;
+    // deadline is the key's current one, passed in since expired keys no longer have it
+    void Record(Shard &shard, const string &key, uint64_t deadline) {
+        if(shard.saves.empty() || shard.touched.contains(key)) return;
+        shard.touched[key] = true;
+
+        auto it = shard.cache.find(key);
+        if(it != shard.cache.end()) shard.undo.push_back({ key, true, it->second, deadline });
+        else shard.undo.push_back({ key, false, {}, deadline });
+    }
+
+    // under the lock of the key's shard, or of every shard when there is no key
+    void Log(Shard *shard, string record) {
+        backlog.Append(shard ? shard->id : 0, move(record));
+    }
+
+    // the record a command leaves in the backlog
+    static string Mutation(const CMDStructure &cmd) {
+        string record;
+        switch(cmd.CMDEnum) {
+            case SET: SyncStream::Pair(record, cmd.key, cmd.value, WallNow() + cmd.TTL * 1000); break;
+            case PSET: SyncStream::Pair(record, cmd.key, cmd.value, WallNow() + cmd.TTL); break;
+            case DELETE: SyncStream::Erase(record, cmd.key); break;
+            case PUSH: SyncStream::Mark(record, SyncStream::PUSH); break;
+            case POP: SyncStream::Mark(record, SyncStream::POP); break;
+            case DELETESAVES: SyncStream::Mark(record, SyncStream::FLATTEN); break;
+            default: break;
+        }
+        return record;
+    }
+
+    // a mutation record as peers compare it, without the deadline each one works out for itself
+    static string Identity(const string &record) {
+        struct Encoder {
+            string out;
+            void Pair(const string &key, const string &value, uint64_t) { SyncStream::Pair(out, key, value, 0); }
+            void Erase(const string &key) { SyncStream::Erase(out, key); }
+            void Mark(SyncStream::RecordType type) { SyncStream::Mark(out, type); }
+            void Position(uint64_t, uint64_t) {}
+            void Start(uint64_t) {}
+        } encoder;
+        SyncStream::Parse(record, encoder);
+        return encoder.out;
+    }
+
+    // TTL in milliseconds
+    Response Set(Shard &shard, string key, string value, time_t TTL) {
         LOGMSG("[ set ] Checking validity of TTL\n");
         if(TTL <= 0) return { "Invalid TTL", false };
 
+        uint64_t deleteTime = Now() + TTL;
+        Record(shard, key, shard.recycleBin.Deadline(key));
+
         int curr = 0;
-        if(cache.find(key) != cache.end())
-            curr = key.size() + cache[key].size();
+        auto it = shard.cache.find(key);
+        if(it != shard.cache.end())
+            curr = key.size() + it->second.value.size();
         
-        if(size.top() - curr + key.size() + value.size() > sizeLimit) {
+        if(shard.size - curr + key.size() + value.size() > shard.sizeLimit) {
             LOGMSG("[ set ] Pair of size %ld does not fit. Storing persistently\n", key.size() + value.size());
-            string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-            ifstream fin(storagepath);
-
-            json object = json::object();
-            fin >> object;
-            fin.close();
-
-            object[key] = value;
-
-            ofstream fout(storagepath);
-            fout << object.dump(4);
-            fout.close();
+            if(it != shard.cache.end()) {
+                shard.size -= curr;
+                shard.cache.erase(it);
+            }
+            shard.spill->Put(key, value);
 
         } else {
             LOGMSG("[ set ] Pair of size %ld does fit. Storing in memory\n", key.size() + value.size());
-            size.top() = size.top() - curr + key.size() + value.size();
-            cache[key] = value;
+            shard.size = shard.size - curr + key.size() + value.size();
+            if(it != shard.cache.end()) it->second = { value, deleteTime };
+            else {
+                shard.cache[key] = { value, deleteTime };
+                shard.spill->Erase(key);
+            }
         }
         
-        time_t deleteTime = time(nullptr) + TTL;
-        LOGMSG("[ set ] Key %s to be removed at %ld\n", key.c_str(), deleteTime);
-        recycleBin.top().push({key, deleteTime});
+        LOGMSG("[ set ] Key %s to be removed at %lu ms\n", key.c_str(), deleteTime);
+        shard.recycleBin.Schedule(key, deleteTime);
+        WakeRecycler(deleteTime);
 
         return { "\"" + key + "\" = \"" + value + "\"", true };
     }
 
-    Response Get(string key) {
-        if(cache.find(key) != cache.end()) {
-            LOGMSG("[ get ] Key found in memory\n");
-            return { "\"" + cache[key] + "\"", true};
-        }
-        string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        ifstream fin(storagepath);
+    // only reads the shard, safe under a shared lock; an expired pair is reported but left
+    // for the exclusive path to remove
+    bool GetCached(Shard &shard, string_view key, Response &resp, bool &expired) {
+        auto it = shard.cache.find(key);
+        expired = it != shard.cache.end() && it->second.expires <= Now();
+        if(it == shard.cache.end() || expired) return false;
 
-        json object = json::object();
-        fin >> object;
-        fin.close();
+        LOGMSG("[ get ] Key found in memory\n");
+        resp = { "\"" + it->second.value + "\"", true};
+        return true;
+    }
 
-        if(object.find(key) != object.end()) {
+    // keys past their deadline are removed by whoever touches them first, the recycler only
+    // has to catch the ones nobody reads
+    bool ExpireIfDue(Shard &shard, const string &key) {
+        auto it = shard.cache.find(key);
+        uint64_t deadline = it != shard.cache.end() ? it->second.expires : shard.recycleBin.Deadline(key);
+        if(deadline > Now()) return false;
+
+        LOGMSG("[ expire ] Key %s expired on access\n", key.c_str());
+        return Delete(shard, key).success;
+    }
+
+    Response Get(Shard &shard, string key) {
+        Response resp;
+        bool expired;
+        if(GetCached(shard, key, resp, expired)) return resp;
+
+        string value;
+        if(shard.spill->Get(key, value)) {
             LOGMSG("[ get ] Key found in file\n");
-            string value = object[key].dump().substr(1);
-            value.pop_back();
-            if(size.top() + key.size() + value.size() <= sizeLimit) {
+            if(shard.size + key.size() + value.size() <= shard.sizeLimit) {
                 LOGMSG("[ get ] Moving pair to memory\n");
-                size.top() += key.size() + value.size();
-                cache[key] = value;
+                uint64_t deadline = shard.recycleBin.Deadline(key);
+                Record(shard, key, deadline);
+                shard.size += key.size() + value.size();
+                shard.cache[key] = { value, deadline };
                 
-                object.erase(key);
-
-                ofstream fout(storagepath);
-                fout << object.dump(4);
-
-                return { "\"" + cache[key] + "\"", true};
+                shard.spill->Erase(key);
             }
 
-            return { object[key].dump(), true };
+            return { "\"" + value + "\"", true};
         }
         
         return { "Key \"" + key + "\" not found", false };
     }
 
-    Response Delete(string key) {
-        if(cache.find(key) != cache.end()) {
-            size.top() -= key.size() + cache[key].size();
-            cache.erase(cache.find(key));
+    Response Delete(Shard &shard, string key) {
+        Record(shard, key, shard.recycleBin.Deadline(key));
+
+        auto it = shard.cache.find(key);
+        if(it != shard.cache.end()) {
+            shard.size -= key.size() + it->second.value.size();
+            shard.cache.erase(it);
+            shard.recycleBin.Cancel(key);
             return { "Key \"" + key + "\" deleted", true };
         }
 
-        string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        ifstream fin(storagepath);
-
-        json object = json::object();
-        fin >> object;
-        fin.close();
-
-        if(object.find(key) == object.end())
+        if(!shard.spill->Erase(key))
             return { "Key \"" + key + "\" not found", false };
 
-        object.erase(key);
-
-        ofstream fout(storagepath);
-        fout << object.dump(4);
+        shard.recycleBin.Cancel(key);
 
         return { "Key \"" + key + "\" deleted", true };
     }
 
     Response Push() {
-        LOGMSG("[ push ] Adding a new recyler bin\n");
-        recycleBin.push(recycleBin.top());
-
-        LOGMSG("[ push ] Saving cache\n");
-        size.push(size.top());
-        cacheSaves.push(cacheSaves.top());
-
-        LOGMSG("[ push ] Creating new json file\n");
-        string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        ofstream storage(storagepath);
-
-        string laststoragepath = "./temp/" + to_string(cacheSaves.size() - 1) + "-" + string(timeString) + ".json";
-        ifstream laststorage(laststoragepath);
-
-        json object = json::object();
-        laststorage >> object;
-
-        storage << object.dump(4);
+        for(auto &s : shards) {
+            Shard &shard = *s;
+            LOGMSG("[ push ] Marking the undo log of shard %d\n", shard.id);
+            shard.saves.push_back({ shard.undo.size(), shard.size });
+            shard.touched.clear();
+
+            LOGMSG("[ push ] Starting a new persistent storage level for shard %d\n", shard.id);
+            shard.spill->Push();
+        }
        
         return { "Cache state saved", true };
     }
 
     Response Pop() {
-        if(cacheSaves.size() < 2) {
+        if(shards[0]->saves.empty()) {
             return { "No saved state to reverse to", false };
         }
 
-        recycleBin.pop();
+        bool snapshots = Reap() > 0;
+        for(auto &s : shards) {
+            Shard &shard = *s;
+            Save save = shard.saves.back();
+            shard.saves.pop_back();
+
+            LOGMSG("[ pop ] Undoing %ld changes in shard %d\n", shard.undo.size() - save.undo, shard.id);
+            for(size_t i = shard.undo.size(); i -- > save.undo; ) {
+                Undo &change = shard.undo[i];
+                if(change.cached) shard.cache[change.key] = move(change.entry);
+                else shard.cache.erase(change.key);
+
+                if(change.deadline == TimingWheel<string>::NEVER) shard.recycleBin.Cancel(change.key);
+                else shard.recycleBin.Schedule(change.key, change.deadline);
+            }
+            shard.undo.resize(save.undo);
+            shard.size = save.size;
+            shard.touched.clear();
 
-        string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        remove(storagepath.c_str());
+            shard.spill->Pop(!snapshots);
 
-        cacheSaves.pop();
-        size.pop();
+            // the restored level may have keys that came due in the meantime
+            WakeRecycler(shard.recycleBin.NextExpiry());
+        }
 
         return { "Cache reversed to last saved state", true };
     }
 
     Response DeleteSaves() {
-        string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        ifstream fin(storagepath);
-
-        json object = json::object();
-        fin >> object;
-        fin.close();
-
-        for(int i = 0; i <= cacheSaves.size(); i ++) {
-            string storagepath = "./temp/" + to_string(i) + "-" + string(timeString) + ".json";
-            remove(storagepath.c_str());
-            LOGMSG("[ delete saves ] Removed %s\n", storagepath.c_str());
+        // the recycler takes the shard locks we are holding, so it can keep running meanwhile
+        for(auto &s : shards) {
+            Shard &shard = *s;
+            shard.spill->Flatten();
+            LOGMSG("[ delete saves ] Flattened %s\n", shard.spill->Path().c_str());
+
+            shard.saves.clear();
+            shard.undo.clear();
+            shard.touched.clear();
         }
 
-        recycling = false;
-        recyclerThread.join();
-
-        priority_queue<Entry> tempRecycle = recycleBin.top();
-        recycleBin = stack<priority_queue<Entry>>();
-        recycleBin.push(tempRecycle);
-
-        recycling = true;
-        recyclerThread = thread(&KeyValueStore::RecycleBin, this);
-
-        int s = size.top();
-        size = stack<int>();
-        size.push(s);
-
-        map<string, string> tempCache = cacheSaves.top();
-        cacheSaves = stack<map<string,string>>();
-        cacheSaves.push(tempCache);
-
-        storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        ofstream storage(storagepath);
-
-        storage << object.dump(4);  
-
         return { "Cache saves deleted", true };
     }
 
     Response Size() {
-        return { to_string(size.top()) + " / " + to_string(sizeLimit) + " bytes", true };
+        int total = 0;
+        for(auto &shard : shards)
+            total += shard->size;
+        return { to_string(total) + " / " + to_string(sizeLimit) + " bytes", true };
     }
 
     Response PrintAll() {
-        string s = "";
-        if(cache.empty()) s.append("Cache is empty\n");
-        else {
-            s.append("Cache contents:\n");
-            for(auto entry : cache)
-                s.append(" - \"" + entry.first + "\" = \"" + entry.second + "\"\n");
-        }
-
-        string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        ifstream fin(storagepath);
-
-        json object = json::object();
-        fin >> object;
-        fin.close();
-
-        if(object.empty()) s.append("Persistent storage is empty\n");
-        else {
-            s.append("Persistent storage:\n");
-            for(auto& [key, value] : object.items()) {
-                s.append(" - \"" + key + "\" = " + value.dump() + '\n');
-            }
-        }
+        // pairs past their deadline are skipped, the recycler hasn't got to them yet
+        uint64_t now = Now();
+        string cached, stored;
+        for(auto &shard : shards)
+            for(auto &[key, entry] : shard->cache)
+                if(entry.expires > now)
+                    cached.append(" - \"" + key + "\" = \"" + entry.value + "\"\n");
+
+        for(auto &shard : shards)
+            shard->spill->ForEach([&](const string &key, const string &value) {
+                if(shard->recycleBin.Deadline(key) > now)
+                    stored.append(" - \"" + key + "\" = \"" + value + "\"\n");
+            });
+
+        string s = cached.empty() ? "Cache is empty\n" : "Cache contents:\n" + cached;
+        s.append(stored.empty() ? "Persistent storage is empty\n" : "Persistent storage:\n" + stored);
 
         s.pop_back();
         return { s, true };
     }
 
     void RecycleBin() {
-        Entry temp;
-        Response resp;
+        vector<pair<string, uint64_t>> expired;
+        vector<string> notifications;
 
         while(recycling) {
-            if(recycleBin.top().empty()) {
-                sleep(1);
-                continue;
+            // while the shards are being scanned every SET reports its deadline
+            nextWake = TimingWheel<string>::NEVER;
+            uint64_t next = TimingWheel<string>::NEVER;
+            uint64_t now = Now();
+            bool backlog = false;
+
+            for(auto &s : shards) {
+                Shard &shard = *s;
+                lock_guard<shared_mutex> lock(shard.mtx);
+
+                // a bounded batch per lock hold, so a burst of expiries doesn't stall the shard
+                expired.clear();
+                backlog |= !shard.recycleBin.Advance(now, expired, EXPIRE_BATCH);
+                for(auto &entry : expired) {
+                    Record(shard, entry.first, entry.second);
+                    Response resp = Delete(shard, entry.first);
+                    if(resp.success) notifications.push_back(resp.value);
+                }
+
+                next = min(next, shard.recycleBin.NextExpiry());
             }
 
-            temp = recycleBin.top().top();
-            if(temp.deleteTime > time(nullptr)) {
-                sleep(1);
-                continue;
+            if(notificationStream)
+                for(auto &notification : notifications)
+                    (*notificationStream) << notification + '\n';
+            notifications.clear();
+
+            // more was due than one batch, go again right away; reads expire those keys meanwhile
+            if(backlog) continue;
+
+            unique_lock<mutex> lock(recyclerMtx);
+            uint64_t until = nextWake = min(next, nextWake.load());
+            auto woken = [&] { return !recycling || nextWake < until; };
+
+            if(until == TimingWheel<string>::NEVER) recyclerCv.wait(lock, woken);
+            else recyclerCv.wait_until(lock, chrono::steady_clock::time_point(chrono::milliseconds(until)), woken);
+        }
+    }
+
+    // sends every level bottom up; a saved level is the live data with the oldest logged change
+    // of each key changed since then put back
+    void SendStacks(SyncStream::Writer &writer) {
+        uint64_t curr = Now(), wall = WallNow();
+        size_t depth = shards[0]->saves.size();
+        for(size_t level = 0; level <= depth; level ++) {
+            for(auto &s : shards) {
+                Shard &shard = *s;
+                FlatIndex<string, const Undo *> changed;
+                if(level < depth)
+                    for(size_t i = shard.saves[level].undo; i < shard.undo.size(); i ++)
+                        if(!changed.contains(shard.undo[i].key)) changed[shard.undo[i].key] = &shard.undo[i];
+
+                // keys already due are left to the recycler
+                auto send = [&](const string &key, const string &value, uint64_t deleteTime) {
+                    if(deleteTime > curr) writer.Pair(key, value, wall + (deleteTime - curr));
+                };
+
+                for(auto &[key, entry] : shard.cache)
+                    if(!changed.contains(key)) send(key, entry.value, entry.expires);
+                for(auto &[key, change] : changed)
+                    if(change->cached) send(key, change->entry.value, change->entry.expires);
+
+                shard.spill->ForEachAt(level, [&](const string &key, const string &value) {
+                    auto it = changed.find(key);
+                    send(key, value, it != changed.end() ? it->second->deadline : shard.recycleBin.Deadline(key));
+                });
             }
 
-            resp = Handler({ DELETE, temp.key, "", 0});
-            if(notificationStream && resp.success) (*notificationStream) << resp.value + '\n';
-            recycleBin.top().pop(); 
+            if(level < depth) writer.Mark(SyncStream::LEVEL);
         }
     }
 
-    void SendStacks(int depth) {
-        if(recycleBin.size() == 0) {
-            LOGMSG("Reached bottom of stack. Going back\n");
-            return;
+    // closes every socket, pipe, epoll and eventfd the child inherited, so client connections and
+    // the listen socket of a hub go away with the parent's copies; regular files like the spill
+    // logs are still read from
+    static void CloseInherited() {
+        vector<int> fds;
+        DIR *dir = opendir("/proc/self/fd");
+        if(dir == nullptr) return;
+        while(dirent *entry = readdir(dir)) {
+            int fd = atoi(entry->d_name);
+            struct stat info;
+            if(fd > 2 && fd != dirfd(dir) && fstat(fd, &info) == 0 && !S_ISREG(info.st_mode))
+                fds.push_back(fd);
         }
-        
-        LOGMSG("Poping stack level: %s\n", to_string(recycleBin.size()).c_str());
-        priority_queue<Entry> tempRecycle = recycleBin.top();
-        map<string, string> tempCache = cacheSaves.top();
+        closedir(dir);
 
-        recycleBin.pop();
-        cacheSaves.pop();
+        for(int fd : fds)
+            close(fd);
+    }
 
-        SendStacks(depth);
+    // runs in the forked child: connects to the hub on a connection of its own, says which client
+    // the stream is for and sends it from the child's copy of the store
+    [[noreturn]] void SendSnapshot(bool incremental, uint64_t offset, int target) {
+        sockaddr_storage hubAddr;
+        socklen_t len = sizeof(hubAddr);
+        if(getpeername(socketfd, (sockaddr *)&hubAddr, &len) == -1) _exit(1);
+        CloseInherited();
+
+        int streamfd = socket(hubAddr.ss_family, SOCK_STREAM, 0);
+        if(streamfd == -1 || connect(streamfd, (sockaddr *)&hubAddr, len) == -1)
+            _exit(1);
+
+        string ack;
+        if(!WriteFrame(streamfd, "STREAM " + to_string(target)) || !ReadFrame(streamfd, ack))
+            _exit(1);
+
+        SyncStream::Writer writer(streamfd);
+        if(incremental) {
+            writer.Start(offset);
+            backlog.ForEachAfter(offset, [&](const string &record) { writer.Append(record); });
+        } else {
+            writer.Mark(SyncStream::RESET);
+            SendStacks(writer);
+        }
+        writer.Position(replId, backlog.Offset());
+        writer.End();
 
-        recycleBin.push(tempRecycle);
-        cacheSaves.push(tempCache);
+        close(streamfd);
+        _exit(0);
+    }
 
-        string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        ifstream fin(storagepath);
+    // deletes every key of the current level, the levels saved below it are left alone
+    void Clear() {
+        vector<string> keys;
+        for(auto &s : shards) {
+            Shard &shard = *s;
+            keys.clear();
+            shard.recycleBin.ForEach([&](const string &key, uint64_t) { keys.push_back(key); });
+            for(auto &key : keys)
+                Delete(shard, key);
+        }
+    }
 
-        json object = json::object();
-        fin >> object;
-        fin.close();
+    // applies the records of a SYNC stream; mutations a peer replays go to the backlog like
+    // our own, the pairs of a full copy don't
+    struct Loader {
+        KeyValueStore &store;
+        uint64_t wall;
+        size_t &loaded;
+
+        // true for a replayed mutation that came from the hub while the request was on its way,
+        // the peer had it too; they come in the same order, interleaved with what we missed
+        bool Applied(const string &record) {
+            if(store.applied.empty() || Identity(record) != store.applied.front()) return false;
+            store.applied.pop_front();
+            return true;
+        }
 
-        priority_queue<Entry> q = tempRecycle;
-        while(!q.empty()) {
-            Entry e = q.top();
-            q.pop();
-            
-            string value = "";
-            if(cache.find(e.key) != cache.end()) {
-                value = cache[e.key];
-            } else if(object.find(e.key) != object.end()) {
-                value = object[e.key].dump().substr(1);
-                value.pop_back();
-            } else continue;
+        void Pair(const string &key, const string &value, uint64_t deadline) {
+            string record;
+            if(!store.fullSync) {
+                SyncStream::Pair(record, key, value, deadline);
+                if(Applied(record)) return;
+            }
 
-            time_t curr = time(NULL);
-            CMDStructure setcmd = { SET, e.key, value, e.deleteTime - curr};
-            LOGMSG("[ handler ] propagating command %s\n", setcmd.toString().c_str());
-            string temp = setcmd.Serialize();
-            int size = temp.size();
-            write(socketfd, &size, sizeof(size));
-            write(socketfd, temp.c_str(), size);
+            if(deadline > wall) {
+                store.Set(store.ShardOf(key), key, value, deadline - wall);
+                loaded ++;
+            }
+            if(!store.fullSync) store.Log(&store.ShardOf(key), move(record));
         }
 
-        if(recycleBin.size() < depth) {
-            CMDStructure pushcmd = { PUSH, "", "", 0 };
-            LOGMSG("[ handler ] propagating command %s\n", pushcmd.toString().c_str());
-            string temp = pushcmd.Serialize();
-            int size = temp.size();
-            write(socketfd, &size, sizeof(size));
-            write(socketfd, temp.c_str(), size); 
+        void Erase(const string &key) {
+            string record;
+            SyncStream::Erase(record, key);
+            if(Applied(record)) return;
+
+            store.Delete(store.ShardOf(key), key);
+            store.Log(&store.ShardOf(key), move(record));
         }
 
+        void Mark(SyncStream::RecordType type) {
+            string record;
+            SyncStream::Mark(record, type);
+            if(Applied(record)) return;
+
+            switch(type) {
+                case SyncStream::RESET:
+                    store.DeleteSaves();
+                    store.Clear();
+                    store.fullSync = true;
+                    return;
+                case SyncStream::LEVEL:
+                    store.Push();
+                    store.Clear();
+                    return;
+                case SyncStream::PUSH: store.Push(); break;
+                case SyncStream::POP: store.Pop(); break;
+                case SyncStream::FLATTEN: store.DeleteSaves(); break;
+                default: return;
+            }
+            store.Log(nullptr, move(record));
+        }
 
-        LOGMSG("Pushing stack level: %s\n", to_string(recycleBin.size()).c_str());
-    }
+        // what we logged since offset is what the hub sent us after we asked
+        void Start(uint64_t offset) {
+            store.applied.clear();
+            if(store.backlog.Covers(offset))
+                store.backlog.ForEachAfter(offset, [&](const string &record) { store.applied.push_back(Identity(record)); });
+        }
+
+        void Position(uint64_t id, uint64_t offset) {
+            store.replId = id;
+            if(store.fullSync) store.backlog.Reset(offset);
+            store.fullSync = false;
+            store.applied.clear();
+        }
+    };
 public:
-    KeyValueStore(int fd, size_t limit, ostream* stream) : sizeLimit(limit), recycling(true), notificationStream(stream), socketfd(fd) { 
+    KeyValueStore(int fd, size_t limit, size_t shardCount, ostream* stream, size_t backlogSize = BACKLOG_SIZE) : sizeLimit(limit), recycling(true), nextWake(TimingWheel<string>::NEVER), notificationStream(stream), socketfd(fd), logging(fd != -1), backlog(backlogSize, shardCount) { 
         time_t curr = time(NULL);
         tm* instanceTime = localtime(&curr);
 
@@ -407,84 +656,235 @@ public:
 
         LOGMSG("[ constructor ] Initialized KVStore\n");
 
-        cacheSaves.push(map<string, string>());
-
-        size.push(0);
-        recycleBin.push(priority_queue<Entry>());
-        recyclerThread = thread(&KeyValueStore::RecycleBin, this);
-
-        LOGMSG("[ constructor ] Started recyler thread\n");
-
         if(access("./temp", F_OK) != 0) {
             mkdir("./temp", 0777);
         }
 
-        string storagepath = "./temp/" + to_string(cacheSaves.size()) + "-" + string(timeString) + ".json";
-        ofstream storage(storagepath);
+        // the size limit is split evenly, the first shards get the remainder
+        if(shardCount == 0) shardCount = 1;
+        for(int i = 0; i < shardCount; i ++) {
+            shards.push_back(make_unique<Shard>());
+            Shard &shard = *shards.back();
+
+            shard.id = i;
+            shard.sizeLimit = limit / shardCount + (i < limit % shardCount);
+            shard.recycleBin = ExpiryIndex<string>(Now());
+            shard.spill = make_unique<SpillLog>(StoragePath(shard));
+        }
+
+        LOGMSG("[ constructor ] Split the store into %ld shards\n", shardCount);
+
+        replId = mt19937_64(random_device{}())();
 
-        json object = json::object();
-        storage << object.dump(4);    
+        recyclerThread = thread(&KeyValueStore::RecycleBin, this);
+
+        LOGMSG("[ constructor ] Started recyler thread\n");
     }
     
     ~KeyValueStore() {
         LOGMSG("[ destructor] Waiting on recycler threads\n");
         recycling = false;
+        {
+            lock_guard<mutex> lock(recyclerMtx);
+            recyclerCv.notify_one();
+        }
         recyclerThread.join();
 
         LOGMSG("[ destructor] Joined all recycler threads\n");
 
-        for(int i = 0; i <= cacheSaves.size(); i ++) {
-            string storagepath = "./temp/" + to_string(i) + "-" + string(timeString) + ".json";
-            remove(storagepath.c_str());
-            LOGMSG("[ destructor ] Removed %s\n", storagepath.c_str());
+        for(pid_t sender : senders)
+            waitpid(sender, nullptr, 0);
+
+        for(auto &shard : shards) {
+            LOGMSG("[ destructor ] Removed %s\n", shard->spill->Path().c_str());
+            shard->spill.reset();
         }
 
         LOGMSG("[ destructor ] Destructed KVStore\n");
     }
 
-    void clearSave() {
-        while(!recycleBin.top().empty()) {
-            Handler({ DELETE, recycleBin.top().top().key, "", 0});
-            recycleBin.top().pop(); 
+    // the hub dropped us; mutations go to the new connection from now on, and the ring we were
+    // in is gone with the old one
+    void Reconnect(int fd) {
+        lock_guard<mutex> socketLock(socketMtx);
+        close(socketfd);
+        socketfd = fd;
+        channel.reset();
+        ring = HashRing();
+        self = -1;
+    }
+
+    // a message for the hub itself rather than a command to propagate
+    void Send(const string &message) {
+        lock_guard<mutex> socketLock(socketMtx);
+        Write(message);
+    }
+
+    // a hub on a unix socket can read us from shared memory instead, without a system call per
+    // message: the ring goes over with RING, and everything after it through the ring
+    void UseRing() {
+        lock_guard<mutex> socketLock(socketMtx);
+        channel = make_unique<ShmRing>(RING_SIZE);
+        int fds[3];
+        channel->Fds(fds);
+        WriteFrame(socketfd, "RING", fds, 3);
+    }
+
+    bool Partitioned() const {
+        return ring.Replication() > 0;
+    }
+
+    // every key is ours unless the keyspace is partitioned
+    bool Owns(string_view key) const {
+        return !Partitioned() || ring.Owns(self, key);
+    }
+
+    // takes on the hub's new ring: a key goes to every owner it didn't have under the old one
+    // and is dropped here once this client isn't one of them. Only the current level moves, the
+    // saved states stay with the client that made them
+    void Repartition(int id, HashRing next) {
+        vector<string> moves;
+        size_t dropped = 0;
+        {
+            auto locks = LockAll();
+            uint64_t now = Now();
+            for(auto &s : shards) {
+                Shard &shard = *s;
+                vector<string> gone;
+                auto visit = [&](const string &key, const string &value, uint64_t deadline) {
+                    if(deadline <= now) return;
+
+                    vector<int> before = ring.Owners(key);
+                    for(int owner : next.Owners(key))
+                        if(owner != id && find(before.begin(), before.end(), owner) == before.end())
+                            moves.push_back("TO " + to_string(owner) + " PSET " + key + " " + value + " " + to_string(deadline - now));
+                    if(!next.Owns(id, key)) gone.push_back(key);
+                };
+
+                for(auto &[key, entry] : shard.cache)
+                    visit(key, entry.value, entry.expires);
+                shard.spill->ForEach([&](const string &key, const string &value) {
+                    visit(key, value, shard.recycleBin.Deadline(key));
+                });
+
+                for(auto &key : gone)
+                    Delete(shard, key);
+                dropped += gone.size();
+            }
+
+            ring = move(next);
+            self = id;
         }
+
+        LOGMSG("[ ring ] Handing over %zu pairs, dropped %zu\n", moves.size(), dropped);
+        for(auto &message : moves)
+            Send(message);
     }
 
-    void SendData() {
-        // sending ALL data to socketfd
-        recycling = false;
-        recyclerThread.join();
+    // a client quitting hands its keys over as if it had already left the ring, so none are lost
+    // when each is held by a single client
+    void Leave() {
+        HashRing next = ring;
+        next.Remove(self);
+        Repartition(self, move(next));
+    }
 
-        cout << "Stopped deleting data. Sending data... ( do not press anything )\n";
-        SendStacks(recycleBin.size());
+    // what to send a peer to SYNC from it
+    string SyncRequest() {
+        auto locks = LockAll();
+        return "SYNC " + to_string(replId) + " " + to_string(backlog.Offset());
+    }
 
-        cout << "Restarting recyler thread\n";
-        recycling = true;
-        recyclerThread = thread(&KeyValueStore::RecycleBin, this);
+    // catches the hub's client target up from offset when it shares our history and the backlog
+    // still has everything after it, otherwise sends it a full copy of every level. A child forked
+    // under every lock sends it from its copy-on-write image of the store, so commands and expiry
+    // go on here meanwhile
+    void SendData(uint64_t id, uint64_t offset, int target) {
+        bool incremental;
+        pid_t pid;
+        {
+            auto locks = LockAll();
+            incremental = id == replId && backlog.Covers(offset);
+
+            Reap();
+            pid = fork();
+            assert(pid != -1);
+            if(pid == 0) SendSnapshot(incremental, offset, target);
+            senders.push_back(pid);
+
+            if(notificationStream) {
+                if(incremental) (*notificationStream) << "Sending " << backlog.Offset() - offset << " missed changes in the background\n";
+                else (*notificationStream) << "Sending a snapshot in the background\n";
+            }
+        }
 
-        // finished sending data
-        char eot = 0x04;
-        int size = sizeof(eot);
-        write(socketfd, &size, sizeof(size));
-        write(socketfd, &eot, size);
+        LOGMSG("[ sync ] Forked sender %d\n", pid);
+    }
+
+    // applies one frame of a SYNC stream straight to the shards, without parsing or propagating
+    // commands; false if it is malformed
+    bool Load(const string &frame, size_t &loaded) {
+        auto locks = LockAll();
+        Loader loader = { *this, WallNow(), loaded };
+        return SyncStream::Parse(frame, loader);
+    }
 
-        cout << "Finished sending data. You may now continue\n";
+    // keys in memory and in the persistent storage, expired ones the recycler hasn't got to included
+    size_t Count() {
+        size_t count = 0;
+        for(auto &shard : shards) {
+            shared_lock<shared_mutex> lock(shard->mtx);
+            count += shard->cache.size() + shard->spill->Count();
+        }
+        return count;
     }
 
-    Response Handler(CMDStructure cmd, bool propagate = false) {
-        mtx.lock();
-        LOGMSG("[ handler ] locked the critical section\n");
+    // cmd points into the caller's line; only what the store keeps is copied out of it
+    Response Handler(const CMDStructure &cmd, bool propagate = false) {
+        Shard *shard = cmd.CMDEnum >= GET ? &ShardOf(cmd.key) : nullptr;
+
+        if(cmd.CMDEnum == GET) {
+            // in-memory hits and keys the persistent storage's filter rules out run in parallel
+            // under a shared lock, anything that may touch the storage falls through to the
+            // exclusive path below
+            shared_lock<shared_mutex> lock(shard->mtx);
+            Response resp;
+            bool expired;
+            if(GetCached(*shard, cmd.key, resp, expired)) return resp;
+            if(!expired && !shard->spill->MayContain(cmd.key)) return { "Key \"" + string(cmd.key) + "\" not found", false };
+        }
+
+        // single key commands only lock the shard owning the key
+        vector<unique_lock<shared_mutex>> locks;
+        if(shard) {
+            locks.emplace_back(shard->mtx);
+            LOGMSG("[ handler ] locked shard %d\n", shard->id);
+        } else if(cmd.CMDEnum != ERROR) {
+            locks = LockAll();
+            LOGMSG("[ handler ] locked all shards\n");
+        }
+
+        // the shard keeps the key, or logs it
+        string key(cmd.key);
+        if(cmd.CMDEnum == GET || cmd.CMDEnum == DELETE)
+            ExpireIfDue(*shard, key);
+
         Response resp;
         bool modifiable = false;
         switch(cmd.CMDEnum) {
             case SET: 
-                resp = Set(cmd.key, cmd.value, cmd.TTL);
+                resp = Set(*shard, key, string(cmd.value), cmd.TTL * 1000);
+                modifiable = true;
+                break;        
+            case PSET: 
+                resp = Set(*shard, key, string(cmd.value), cmd.TTL);
                 modifiable = true;
                 break;        
             case GET: 
-                resp = Get(cmd.key);
+                resp = Get(*shard, key);
                 break;        
             case DELETE: 
-                resp = Delete(cmd.key);
+                resp = Delete(*shard, key);
                 modifiable = true;
                 break;        
             case PUSH:
@@ -509,59 +909,44 @@ public:
                 resp ={ cmd.toString(), false };
                 break;
         }
+        // peers only send what succeeded on their side, so whatever arrives counts even if it
+        // failed here; that keeps the offsets of stores sharing a history in step
+        if(logging && modifiable && (resp.success || !propagate)) Log(shard, Mutation(cmd));
+
         if(propagate && resp.success && modifiable) {
             LOGMSG("[ handler ] propagating command %s\n", cmd.toString().c_str());
-            string temp = cmd.Serialize();
-            write(socketfd, temp.c_str(), temp.size());
+            lock_guard<mutex> socketLock(socketMtx);
+            Write(cmd.Serialize());
         }
-        mtx.unlock();
+        locks.clear();
         LOGMSG("[ handler ] unlocked the critical section\n");
         return resp;
     }
+};
 
-    friend CMDStructure InputParser(string raw) {
-        CMDStructure cmd = { ERROR, "", "", 0 };
-        int p = raw.find(' ');
-        string temp = raw.substr(0, p);
-        
-        if(CMDStringToEnum.find(temp) == CMDStringToEnum.end())
-            return { ERROR, "", "", 0 };
-        
-        cmd.CMDEnum = CMDStringToEnum[temp];
-
-        if(p == raw.npos ^ cmd.CMDEnum < GET) return { ERROR, "", "", 0 };
-        if(p == raw.npos) return cmd;
-
-        raw = raw.substr(p + 1);
-        p = raw.find(' ');
-        cmd.key = raw.substr(0, p);
-
-        if(p == raw.npos ^ cmd.CMDEnum < SET) return { ERROR, "", "", 0 };
-        if(p == raw.npos) return cmd;
-
-        raw = raw.substr(p + 1);
-        p = raw.find(' ');
-        cmd.value = raw.substr(0, p);
-
-        if(p == raw.npos) return { ERROR, "", "", 0 };
+#define DEBUGMSG(format, ...) if(DEBUG) fprintf(stderr, format, ##__VA_ARGS__)
+bool DEBUG = false;
 
-        raw = raw.substr(p + 1);
-        p = raw.find(' ');
-        if(p != raw.npos) return { ERROR, "", "", 0 }; 
+// where the hub listens: a TCP address, or a unix socket when the clients share its host
+struct Address {
+    sockaddr_storage storage {};
+    socklen_t len = 0;
 
-        cmd.TTL = atoi(raw.c_str());
-        if(cmd.TTL <= 0) return { ERROR, "", "", 0 }; 
-        
-        return cmd;
-    }
-
-    #undef cache
+    sockaddr *Get() { return (sockaddr *)&storage; }
+    int Family() const { return storage.ss_family; }
 };
 
-#define DEBUGMSG(format, ...) if(DEBUG) fprintf(stderr, format, ##__VA_ARGS__)
-bool DEBUG = false;
+// a path (anything with a '/') names a unix socket, otherwise it's a TCP [address:]port
+Address StrToAddr(char *str) {
+    Address address;
+    if(strchr(str, '/') != NULL) {
+        sockaddr_un *local = (sockaddr_un *)&address.storage;
+        local->sun_family = AF_UNIX;
+        strncpy(local->sun_path, str, sizeof(local->sun_path) - 1);
+        address.len = sizeof(sockaddr_un);
+        return address;
+    }
 
-sockaddr_in StrToAddr(char *str) {
     char ADDR[18] = "127.0.0.1";
     int PORT = 0;
     
@@ -573,29 +958,196 @@ sockaddr_in StrToAddr(char *str) {
         strcpy(ADDR, str);
     } 
 
-    return {
+    sockaddr_in *remote = (sockaddr_in *)&address.storage;
+    *remote = {
         AF_INET,
         htons(PORT),
         in_addr {
             inet_addr(ADDR)
         }
     };
+    address.len = sizeof(sockaddr_in);
+    return address;
 }
 
-char *conv_addr(struct sockaddr_in address) {
-    static char str[25];
+char *conv_addr(Address address) {
+    static char str[110];
+    if(address.Family() == AF_UNIX) {
+        strcpy(str, ((sockaddr_un *)&address.storage)->sun_path);
+        return str;
+    }
+
+    sockaddr_in *remote = (sockaddr_in *)&address.storage;
     char port[7];
 
     /* adresa IP a clientului */
-    strcpy(str, inet_ntoa(address.sin_addr));
+    strcpy(str, inet_ntoa(remote->sin_addr));
     /* portul utilizat de client */
     bzero(port, 7);
-    sprintf(port, ":%d", ntohs(address.sin_port));
+    sprintf(port, ":%d", ntohs(remote->sin_port));
     strcat(str, port);
     return (str);
 }
 
-void distributionHandler(int socketfd) {
+// .config: <size limit in bytes> [shard count] [backlog size in bytes] [hub queue limit in bytes]
+// [drop | disconnect | backpressure] [hub threads] [replica | -] [copies of a key, 0 for all on
+// every client]; the hub's settings only matter to the client that starts the hub
+struct Config {
+    size_t size = 0, shards = 0, backlogSize = 0, queueLimit = 0, hubThreads = 0, replication = 0;
+    Hub::Policy policy = Hub::DISCONNECT;
+    bool replica = false;
+};
+
+Config ReadConfig() {
+    Config config;
+    string policyName, replica;
+
+    ifstream fin(".config");
+    fin >> config.size >> config.shards >> config.backlogSize >> config.queueLimit >> policyName >> config.hubThreads >> replica >> config.replication;
+    if(config.shards == 0) config.shards = thread::hardware_concurrency();
+    if(config.backlogSize == 0) config.backlogSize = KeyValueStore::BACKLOG_SIZE;
+    if(config.queueLimit == 0) config.queueLimit = Hub::QUEUE_LIMIT;
+    if(config.hubThreads == 0) config.hubThreads = thread::hardware_concurrency();
+
+    if(policyName == "drop") config.policy = Hub::DROP;
+    if(policyName == "backpressure") config.policy = Hub::BACKPRESSURE;
+    config.replica = replica == "replica";
+
+    return config;
+}
+
+// the hub's messages are frames, however the reads cut them
+bool NextFrame(int socketfd, FrameBuffer &incoming, string &frame) {
+    while(!incoming.Next(frame))
+        if(incoming.Read(socketfd) <= 0) return false;
+    return true;
+}
+
+// applies a frame the hub passed on: another client's command, a SYNC to answer, METRICS or, if
+// the keyspace is partitioned, the ring, a question about one of our keys or an answer to ours;
+// returns what to show for it
+string FromHub(KeyValueStore &store, const string &frame) {
+    if(frame.compare(0, 8, "METRICS\n") == 0) return frame.substr(8);
+    if(frame.compare(0, 7, "ANSWER ") == 0) return frame.substr(7) + '\n';
+
+    // RING <this client> <copies of a key> <members...>
+    if(frame.compare(0, 5, "RING ") == 0) {
+        istringstream in(frame.substr(5));
+        int self, member;
+        size_t replication = 0;
+        in >> self >> replication;
+        if(replication == 0) return "";
+
+        HashRing ring(replication);
+        while(in >> member)
+            ring.Add(member);
+        size_t members = ring.Members().size();
+        store.Repartition(self, move(ring));
+
+        return "The keyspace is split over " + to_string(members) + " clients, " + to_string(min(replication, members)) + " holding each key\n";
+    }
+
+    // ASK <requester> <command>
+    if(frame.compare(0, 4, "ASK ") == 0) {
+        size_t end = frame.find(' ', 4);
+        CMDStructure cmd = InputParser(end != string::npos ? string_view(frame).substr(end + 1) : "");
+        string answer = cmd.CMDEnum != ERROR ? store.Handler(cmd).value : "Invalid command";
+        store.Send("ANSWER " + frame.substr(4, end - 4) + " " + answer);
+        return "";
+    }
+
+    uint64_t id, offset;
+    int target;
+    if(sscanf(frame.c_str(), "SYNC %lu %lu %d", &id, &offset, &target) == 3) {
+        store.SendData(id, offset, target);
+        return "";
+    }
+
+    CMDStructure cmd = InputParser(frame);
+    if(cmd.CMDEnum == ERROR) return "";
+
+    return store.Handler(cmd).value + '\n';
+}
+
+// asks the hub for a SYNC and loads the answer; false if no other client could send one, or if
+// the stream was cut short by a lost connection or a malformed frame. What comes before the
+// answer is applied as usual, the peer has it too and an incremental stream skips it again
+// (Loader::Applied); out shows what it all did
+bool Sync(KeyValueStore &store, int socketfd, FrameBuffer &incoming, ostream *out) {
+    store.Send(store.SyncRequest());
+
+    // the answer is the only frame of one byte, the hub holds back everything after it for us
+    // until the stream is over
+    string frame;
+    while(true) {
+        if(!NextFrame(socketfd, incoming, frame)) return false;
+        if(frame.size() == 1) break;
+
+        string shown = FromHub(store, frame);
+        if(out) (*out) << shown;
+    }
+
+    if(frame != string(1, true)) {
+        if(out) (*out) << "No other client to sync with\n";
+        return false;
+    }
+
+    if(out) (*out) << "Syncing...\n";
+
+    // after a malformed frame the rest of the stream is only read past
+    size_t loaded = 0;
+    bool whole = true, ended = false;
+    while(!ended && NextFrame(socketfd, incoming, frame)) {
+        ended = SyncStream::Ended(frame);
+        if(!ended && whole) whole = store.Load(frame, loaded);
+    }
+
+    if(!ended || !whole) {
+        if(out) (*out) << "Sync cut short after " << loaded << " pairs\n";
+        return false;
+    }
+
+    if(out) (*out) << "Loaded " << loaded << " pairs\nFinished syncing\n";
+    return true;
+}
+
+// says HELLO to the hub and waits for the ring it answers with, applying whatever comes first
+bool Join(KeyValueStore &store, int socketfd, FrameBuffer &incoming, ostream *out) {
+    store.Send("HELLO");
+
+    string frame;
+    do {
+        if(!NextFrame(socketfd, incoming, frame)) return false;
+
+        string shown = FromHub(store, frame);
+        if(out) (*out) << shown;
+    } while(frame.compare(0, 5, "RING ") != 0);
+    return true;
+}
+
+// the hub's replica: a store in the hub's process kept up by the broadcasts like any client's.
+// Started empty it would wipe whoever synced from it, so it first syncs from a client, as many
+// times as it takes, and only then tells the hub it can answer SYNC requests
+void Replicate(int socketfd, Config config) {
+    KeyValueStore replica(socketfd, config.size, config.shards, nullptr, config.backlogSize);
+    FrameBuffer incoming;
+    string frame;
+
+    while(!Sync(replica, socketfd, incoming, nullptr)) {
+        pollfd event = { socketfd, POLLIN, 0 };
+        if(poll(&event, 1, 1000) <= 0) continue;
+
+        if(incoming.Read(socketfd) <= 0) return;
+        while(incoming.Next(frame))
+            FromHub(replica, frame);
+    }
+    replica.Send("READY");
+
+    while(NextFrame(socketfd, incoming, frame))
+        FromHub(replica, frame);
+}
+
+void distributionHandler(int socketfd, const Config &config) {
     pid_t pid = fork();
     assert(pid != -1);
 
@@ -621,138 +1173,305 @@ void distributionHandler(int socketfd) {
     assert(setsid() != -1);
     LOGMSG("[ status ] Detached successfully\n");
 
-    assert(listen(socketfd, 5) == 0);
+    // a client gone mid-write shows up as a failed write and a disconnect, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    assert(listen(socketfd, SOMAXCONN) == 0);
     LOGMSG("[ status ] Started up multiplexing server\n");
 
-    fd_set readfds, actfds;
-    struct timeval tv = { 1, 0 };
+    thread replica;
+    {
+        Hub hub(socketfd, LOG, config.queueLimit, config.policy, config.hubThreads, config.replication);
+
+        // the replica connects to the hub like a client, the hub tells it apart by its address; a
+        // partitioned keyspace has no single copy for it to keep
+        if(config.replica && config.replication == 0) {
+            sockaddr_storage address;
+            socklen_t len = sizeof(address);
+            assert(getsockname(socketfd, (sockaddr *)&address, &len) == 0);
+            int replicafd = socket(address.ss_family, SOCK_STREAM, 0);
+            assert(replicafd != -1);
+
+            // a unix socket connects without a name unless it binds one, an abstract one here
+            if(address.ss_family == AF_UNIX) {
+                sockaddr_un name = { AF_UNIX, {} };
+                int size = snprintf(name.sun_path + 1, sizeof(name.sun_path) - 1, "kvstore-replica-%d", getpid());
+                assert(bind(replicafd, (sockaddr *)&name, offsetof(sockaddr_un, sun_path) + 1 + size) == 0);
+            }
 
-    FD_ZERO(&actfds);
-    FD_SET(socketfd, &actfds);
+            assert(connect(replicafd, (sockaddr *)&address, len) == 0);
+            len = sizeof(address);
+            assert(getsockname(replicafd, (sockaddr *)&address, &len) == 0);
 
-    int clientCount = 0;
-    bool running = true;
-
-    int maxfd = socketfd;
-    while(running) {
-        bcopy((char *)&actfds, (char *)&readfds, sizeof(readfds));
+            hub.Replica((sockaddr *)&address, len);
+            replica = thread(Replicate, replicafd, config);
+            LOGMSG("[ status ] Started the replica\n");
+        }
 
-        assert(select(maxfd + 1, &readfds, NULL, NULL, &tv) >= 0);
+        hub.Run();
+    }
 
-        if(FD_ISSET(socketfd, &readfds)) {
-            struct sockaddr_in clientAddr;
-            int clientAddrLen = sizeof(clientAddr);
+    // the hub closed its end of the replica's connection on the way out
+    if(replica.joinable()) replica.join();
 
-            int clientfd = accept(socketfd, (struct sockaddr*)&clientAddr, (socklen_t *)&clientAddrLen);
-            if(maxfd < clientfd) maxfd = clientfd;
+    LOGMSG("[ status ] Shutting down server\n");
 
-            LOGMSG("[ connection ] New client with fd #%d from address %s\n", clientfd, conv_addr(clientAddr));
+    // a unix socket's file outlives the socket and would keep the next hub from binding
+    sockaddr_storage address;
+    socklen_t len = sizeof(address);
+    if(getsockname(socketfd, (sockaddr *)&address, &len) == 0 && address.ss_family == AF_UNIX)
+        unlink(((sockaddr_un *)&address)->sun_path);
 
-            FD_SET(clientfd, &actfds);
-            clientCount ++;
-        }
+    fclose(LOG);
+    close(socketfd);
+    exit(0);   
+}
 
-        for(int fd = 3; fd <= maxfd; fd ++)
-            if(fd != socketfd && FD_ISSET(fd, &readfds)) {
-                char buffer[256] = { 0 };
-                int bytes = read(fd, buffer, sizeof(buffer));
+// a unix socket's file left behind by a hub that is gone, nobody answers on it
+bool Stale(Address address) {
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool stale = connect(probe, address.Get(), address.len) == -1 && errno == ECONNREFUSED;
+    close(probe);
+    return stale;
+}
 
-                if(bytes == 0) {
-                    LOGMSG("[ connection ] Client disconnected with fd #%d\n", fd);
-                    close(fd);
-                    FD_CLR(fd, &actfds);
-                    clientCount --;
-                    if(clientCount == 0) running = false;
+// connects to the hub at serverAddr, starting it first if nobody has yet
+int JoinHub(Address serverAddr, const Config &config) {
+    if(serverAddr.Family() == AF_UNIX && Stale(serverAddr))
+        unlink(((sockaddr_un *)&serverAddr.storage)->sun_path);
 
-                    continue;
-                }
+    int socketfd = socket(serverAddr.Family(), SOCK_STREAM, 0);
+    assert(socketfd != -1);
 
-                if(bytes < 0) continue;
+    DEBUGMSG("[ status ] Created socket\n");
 
-                if(strcmp(buffer, "SYNC") == 0) {
-                    bool found = clientCount > 1;
-                    write(fd, &found, sizeof(found));
+    int optval = 1;
+    setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR,&optval,sizeof(optval));
 
-                    if(!found) continue;
-                    int syncerfd;
-                    for (syncerfd = 3; syncerfd <= maxfd; syncerfd++)
-                        if (syncerfd != socketfd && syncerfd != fd && FD_ISSET(syncerfd, &actfds))
-                            break;
+    DEBUGMSG("[ status ] Set reusable option to socket\n");
 
-                    write(syncerfd, buffer, sizeof(buffer));
+    DEBUGMSG("[ status ] Attempting to bind socket to %s\n", conv_addr(serverAddr));
+    if(bind(socketfd, serverAddr.Get(), serverAddr.len) == 0) {
+        distributionHandler(socketfd, config);
+    } else assert(errno == EADDRINUSE);
+    close(socketfd);
 
-                    while(true) {
-                        int size;
-                        read(syncerfd, &size, sizeof(size));
+    DEBUGMSG("[ client - status ] Waiting for server to boot up\n");
+    sleep(1);
 
-                        char buffer[256] = { 0 };
-                        int bytes = read(syncerfd, buffer, size);
+    DEBUGMSG("[ client - status ] Attempting to connect to %s\n", conv_addr(serverAddr));
 
-                        if(bytes <= 0) break;
+    socketfd = socket(serverAddr.Family(), SOCK_STREAM, 0);
+    assert(connect(socketfd, serverAddr.Get(), serverAddr.len) != -1);
+    DEBUGMSG("[ client - status ] Connected to server\n");
 
-                        write(fd, &size, sizeof(size));
-                        write(fd, buffer, bytes);
+    return socketfd;
+}
 
-                        if(bytes == 1 && buffer[0] == 0x04) break;
-                    }
+// commands are case insensitive, keys and values included
+void Capitalize(string &line) {
+    for(auto &c : line)
+        if(c >= 'a' && c <= 'z')
+            c += 'A' - 'a';
+}
 
-                    continue;
-                }
+// a redis SET without an expiry; every pair here has one, this one outlives the process
+const time_t KEEP = MAX_TTL;
+
+// answers one RESP request (Resp.hpp) by mapping it onto the store's commands; keys and values
+// keep their case. false if the client asked to close the connection
+bool RespCommand(KeyValueStore &store, const vector<string_view> &args, string &out) {
+    string name(args[0]);
+    Capitalize(name);
+    auto arity = [&](size_t least, size_t most) {
+        if(args.size() >= least && args.size() <= most) return true;
+        for(auto &c : name) c = tolower(c);
+        Resp::Error(out, "ERR wrong number of arguments for '" + name + "' command");
+        return false;
+    };
+    auto ttl = [&](string_view arg, time_t unit, time_t &TTL) {
+        time_t count = 0;
+        from_chars(arg.data(), arg.data() + arg.size(), count);
+        if(count > 0 && count <= MAX_TTL / unit) {
+            TTL = count * unit;
+            return true;
+        }
+        Resp::Error(out, "ERR invalid expire time");
+        return false;
+    };
 
-                LOGMSG("[ transmission ] From fd #%d: %s\n", fd, buffer);
-                for(int writefd = 3; writefd <= maxfd; writefd ++)
-                    if(writefd != socketfd && writefd != fd) {
-                        write(writefd, buffer, bytes);
-                    }
+    CMDStructure cmd = { PSET, "", "", KEEP };
+    if(name == "PING") {
+        if(!arity(1, 2)) return true;
+        if(args.size() == 2) Resp::Bulk(out, args[1]);
+        else Resp::Simple(out, "PONG");
+
+    } else if(name == "ECHO") {
+        if(arity(2, 2)) Resp::Bulk(out, args[1]);
+
+    } else if(name == "SET" || name == "SETEX" || name == "PSETEX") {
+        // SET key value [EX seconds | PX milliseconds], SETEX / PSETEX key TTL value
+        bool set = name == "SET";
+        if(!arity(set ? 3 : 4, set ? 5 : 4)) return true;
+
+        cmd.key = args[1];
+        cmd.value = args[set ? 2 : 3];
+        if(!set && !ttl(args[2], name == "SETEX" ? 1000 : 1, cmd.TTL)) return true;
+        if(set && args.size() == 5) {
+            string option(args[3]);
+            Capitalize(option);
+            if(option != "EX" && option != "PX") {
+                Resp::Error(out, "ERR syntax error");
+                return true;
             }
-    }
+            if(!ttl(args[4], option == "EX" ? 1000 : 1, cmd.TTL)) return true;
+        } else if(set && args.size() == 4) {
+            Resp::Error(out, "ERR syntax error");
+            return true;
+        }
 
-    LOGMSG("[ status ] Shutting down server\n");
+        Response resp = store.Handler(cmd);
+        if(resp.success) Resp::Simple(out, "OK");
+        else Resp::Error(out, "ERR " + resp.value);
 
-    fclose(LOG);
-    close(socketfd);
-    exit(0);   
+    } else if(name == "GET") {
+        if(!arity(2, 2)) return true;
+
+        cmd = { GET, args[1] };
+        Response resp = store.Handler(cmd);
+        if(resp.success) Resp::Bulk(out, string_view(resp.value).substr(1, resp.value.size() - 2));
+        else Resp::Null(out);
+
+    } else if(name == "DEL" || name == "EXISTS") {
+        if(!arity(2, SIZE_MAX)) return true;
+
+        int64_t count = 0;
+        for(size_t i = 1; i < args.size(); i ++) {
+            cmd = { name == "DEL" ? DELETE : GET, args[i] };
+            count += store.Handler(cmd).success;
+        }
+        Resp::Integer(out, count);
+
+    } else if(name == "DBSIZE") {
+        if(arity(1, 1)) Resp::Integer(out, store.Count());
+
+    } else if(name == "PUSH" || name == "POP" || name == "DELETESAVES") {
+        if(!arity(1, 1)) return true;
+
+        cmd = { FindCommand(name) };
+        Response resp = store.Handler(cmd);
+        if(resp.success) Resp::Simple(out, "OK");
+        else Resp::Error(out, "ERR " + resp.value);
+
+    } else if(name == "CONFIG" || name == "COMMAND") {
+        // what redis-benchmark and redis-cli ask about the server when they connect
+        Resp::Array(out, 0);
+
+    } else if(name == "QUIT") {
+        Resp::Simple(out, "OK");
+        return false;
+
+    } else {
+        Resp::Error(out, "ERR unknown command '" + string(args[0]) + "'");
+    }
+    return true;
 }
 
-int main(int argc, char **argv) {
-    if(argc != 2 && argc != 3) {
-        cerr << "Usage: " << argv[0] << " <[address:]port> [-d]\n";
+// owns a store and answers requests on address (Server.hpp) until SIGINT or SIGTERM, in frames
+// or, with resp, in the redis protocol
+int Serve(Address address, const Config &config, bool resp) {
+    if(address.Family() == AF_UNIX && Stale(address))
+        unlink(((sockaddr_un *)&address.storage)->sun_path);
+
+    int listenfd = socket(address.Family(), SOCK_STREAM, 0);
+    assert(listenfd != -1);
+
+    int optval = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if(bind(listenfd, address.Get(), address.len) == -1 || listen(listenfd, SOMAXCONN) == -1) {
+        cerr << "Cannot listen on " << conv_addr(address) << ": " << strerror(errno) << '\n';
         return -1;
     }
 
-    if(argc == 3) {
-        if(strcmp(argv[2], "-d") == 0) DEBUG = true;
-        else {
-            cerr << "Usage: " << argv[0] << " <[address:]port> [-d]\n";
-            return -1;
+    // every thread started from here on inherits the mask, the signals only reach sigwait
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    KeyValueStore store(-1, config.size, config.shards, nullptr, config.backlogSize);
+    Server::Protocol protocol = Server::Frames([&](const string &request) {
+        string line = request;
+        Capitalize(line);
+        CMDStructure cmd = InputParser(line);
+        if(cmd.CMDEnum == ERROR) return string("ERR Invalid command");
+
+        Response resp = store.Handler(cmd);
+        return (resp.success ? "OK " : "ERR ") + resp.value;
+    });
+
+    // a pipeline is answered in one go, a malformed request gets an error and a closed connection
+    if(resp) protocol = [&](string_view input, string &output) {
+        vector<string_view> args;
+        size_t used = 0, size;
+        while(true) {
+            Resp::Status status = Resp::Parse(input.substr(used), args, size);
+            if(status == Resp::PARTIAL) return used;
+            if(status == Resp::INVALID) {
+                Resp::Error(output, "ERR Protocol error");
+                return string::npos;
+            }
+
+            used += size;
+            if(!args.empty() && !RespCommand(store, args, output)) return string::npos;
         }
-    }
+    };
 
-    int socketfd = socket(AF_INET, SOCK_STREAM, 0);
-    assert(socketfd != -1);
+    Server server(listenfd, protocol, config.hubThreads);
 
-    DEBUGMSG("[ status ] Created socket\n");
+    thread stopper([&] {
+        int caught;
+        sigwait(&signals, &caught);
+        server.Stop();
+    });
 
-    int optval = 1;
-    setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR,&optval,sizeof(optval));
+    cout << "Serving " << (resp ? "RESP" : "frames") << " on " << conv_addr(address) << " with " << config.hubThreads << " threads" << endl;
+    server.Run();
+    stopper.join();
 
-    DEBUGMSG("[ status ] Set reusable option to socket\n");
+    if(address.Family() == AF_UNIX) unlink(((sockaddr_un *)&address.storage)->sun_path);
+    close(listenfd);
+    return 0;
+}
 
-    struct sockaddr_in serverAddr = StrToAddr(argv[1]);
+int main(int argc, char **argv) {
+    // -d prints debug messages, -s serves requests instead of joining a hub, -r serves them in the
+    // redis protocol, -m writes to a hub on a unix socket through shared memory
+    bool serve = false, resp = false, shared = false, valid = argc >= 2;
+    for(int i = 2; i < argc; i ++) {
+        if(strcmp(argv[i], "-d") == 0) DEBUG = true;
+        else if(strcmp(argv[i], "-s") == 0) serve = true;
+        else if(strcmp(argv[i], "-r") == 0) serve = resp = true;
+        else if(strcmp(argv[i], "-m") == 0) shared = true;
+        else valid = false;
+    }
 
-    DEBUGMSG("[ status ] Attempting to bind socket to %s\n", conv_addr(serverAddr));
-    if(bind(socketfd, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) == 0) {
-        distributionHandler(socketfd);
-    } else assert(errno == EADDRINUSE);
+    Address serverAddr;
+    if(valid) serverAddr = StrToAddr(argv[1]);
+    if(shared && (serve || serverAddr.Family() != AF_UNIX)) valid = false;
 
-    DEBUGMSG("[ client - status ] Waiting for server to boot up\n");
-    sleep(1);
+    if(!valid) {
+        cerr << "Usage: " << argv[0] << " <[address:]port | socket path> [-d] [-s | -r | -m]\n";
+        return -1;
+    }
 
-    DEBUGMSG("[ client - status ] Attempting to connect to %s\n", conv_addr(serverAddr));
+    Config config = ReadConfig();
 
-    socketfd = socket(AF_INET, SOCK_STREAM, 0);
-    assert(connect(socketfd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) != -1);
-    DEBUGMSG("[ client - status ] Connected to server\n");
+    if(serve) return Serve(serverAddr, config, resp);
+
+    int socketfd = JoinHub(serverAddr, config);
 
     fd_set readfds, actfds;
     struct timeval tv = { 1, 0 };
@@ -763,107 +1482,107 @@ int main(int argc, char **argv) {
 
     bool running = true;
 
-    ifstream fin(".config");
-    size_t size = 0;
-    fin >> size;
+    KeyValueStore KVStore(socketfd, config.size, config.shards, &cout, config.backlogSize);
+
+    // stdin is split into lines and the hub's messages into frames, however the reads cut them
+    string input, frame;
+    FrameBuffer incoming;
+
+    // frames read but not handled yet, a Sync or Join reads past what it waits for; select
+    // won't report them again
+    auto drain = [&] {
+        while(incoming.Next(frame))
+            cout << FromHub(KVStore, frame);
+    };
 
-    KeyValueStore KVStore(socketfd, size, &cout);
+    if(shared) KVStore.UseRing();
+    Join(KVStore, socketfd, incoming, &cout);
 
     while(running) {
+        drain();
         bcopy((char *)&actfds, (char *)&readfds, sizeof(readfds));
 
         assert(select(socketfd + 1, &readfds, NULL, NULL, &tv) >= 0);
        
         if(FD_ISSET(0, &readfds)) {
-            char buffer[256] = { 0 };
+            char buffer[4096];
             int bytes = read(0, buffer, sizeof(buffer));
 
-            if(bytes <= 0) continue;
+            // piped input that ran out, keep serving the hub
+            if(bytes <= 0) FD_CLR(0, &actfds);
+            else input.append(buffer, bytes);
+        }
 
-            buffer[bytes - 1] = '\0';
-            for(int i = 0; i < bytes; i ++)
-                if(buffer[i] >= 'a' && buffer[i] <= 'z')
-                    buffer[i] += 'A' - 'a';
+        // a SYNC reads the socket after select looked at it, which may leave it empty
+        bool synced = false;
+        size_t end;
+        while(running && (end = input.find('\n')) != string::npos) {
+            string line = input.substr(0, end);
+            input.erase(0, end + 1);
+            Capitalize(line);
             
-            if(strcmp(buffer, "QUIT") == 0) {
+            if(line == "QUIT") {
+                if(KVStore.Partitioned()) KVStore.Leave();
                 running = 0;
                 continue;
             }
 
-            if(strcmp(buffer, "--HELP") == 0) {
-                cout << "\t\t\tCommand List\n\n1. SET <key> <value> <TTL>  | Sets the value of a key a defined period of time\n2. GET <key>                | Returns the value of a key\n3. DELETE <key>             | Deletes a key and its value\n4. SIZE                     | Returns the size of the cache\n5. PRINTALL                 | Prints all keys and their values\n6. PUSH                     | Saves the current state\n7. POP                      | Returns to previous saved state\n8. DELETESAVES              | Deletes all saved states\n9. SYNC                     | Synchronizes database\n10. QUIT                    | Quits the program\n11. HELP                    | Displays this list\n";
+            if(line == "--HELP") {
+                cout << "\t\t\tCommand List\n\n1. SET <key> <value> <TTL>  | Sets the value of a key a defined period of time ( seconds )\n   PSET <key> <value> <TTL> | Same as SET, TTL in milliseconds\n2. GET <key>                | Returns the value of a key\n3. DELETE <key>             | Deletes a key and its value\n4. SIZE                     | Returns the size of the cache\n5. PRINTALL                 | Prints all keys and their values\n6. PUSH                     | Saves the current state\n7. POP                      | Returns to previous saved state\n8. DELETESAVES              | Deletes all saved states\n9. SYNC                     | Synchronizes database\n10. METRICS                 | Shows the hub's outbound queue of every client\n11. QUIT                    | Quits the program\n12. HELP                    | Displays this list\n";
                 continue;
             }
 
-            if(strcmp(buffer, "SYNC") == 0) {
-                write(socketfd, buffer, strlen(buffer));
-                
-                bool found;
-                read(socketfd, &found, sizeof(found));
-
-                if(!found) {
-                    cout << "No other client to sync with\n";
-                    continue;
-                }
-
-                cout << "Syncing...\n";
-
-                while(true) {
-                    int size;
-                    read(socketfd, &size, sizeof(size));
-
-                    char buffer[256] = { 0 };
-                    int bytes = read(socketfd, buffer, size);
-
-                    // cout << "Received: " << buffer << '\n';
-
-                    if(bytes <= 0) continue;
-
-                    if(bytes == 1 && buffer[0] == 0x04) break;
-
-                    CMDStructure cmd = InputParser(buffer);
-                    if(cmd.CMDEnum == ERROR) continue;
-
-                    Response resp = KVStore.Handler(cmd);
-
-                    cout << resp.value << '\n';
-
-                    if(cmd.CMDEnum == PUSH)
-                        KVStore.clearSave();
+            if(line == "SYNC") {
+                if(KVStore.Partitioned()) cout << "The keyspace is partitioned, keys reach their owners as clients come and go\n";
+                else {
+                    Sync(KVStore, socketfd, incoming, &cout);
+                    drain();
+                    synced = true;
                 }
+                continue;
+            }
 
-                cout << "Finished syncing\n";
+            if(line == "METRICS") {
+                KVStore.Send("METRICS");
                 continue;
             }
 
-            CMDStructure cmd = InputParser(buffer);
+            CMDStructure cmd = InputParser(line);
             if(cmd.CMDEnum == ERROR) {
                 cout << "Invalid command. Type 'HELP' to get a list of all valid commands\n";
                 continue;
             }   
 
+            // a key held by other clients is asked about through the hub, the answer comes later
+            if(cmd.CMDEnum >= GET && !KVStore.Owns(cmd.key)) {
+                KVStore.Send("ASK " + cmd.Serialize());
+                continue;
+            }
+
             Response resp = KVStore.Handler(cmd, true);
                        
             cout << resp.value << '\n';
         }
         
-        if(FD_ISSET(socketfd, &readfds)) {
-            char buffer[256] = { 0 };
-            int bytes = read(socketfd, buffer, sizeof(buffer));
-
-            if(bytes <= 0) continue;
-
-            if(strcmp(buffer, "SYNC") == 0) {
-                KVStore.SendData();
+        if(!synced && FD_ISSET(socketfd, &readfds)) {
+            // the hub dropped us for falling behind, or went away; whatever we missed is
+            // caught up with, incrementally if a peer's backlog still has it
+            if(incoming.Read(socketfd) <= 0) {
+                cout << "Lost the hub, reconnecting" << endl;
+                FD_CLR(socketfd, &actfds);
+                socketfd = JoinHub(serverAddr, config);
+                FD_SET(socketfd, &actfds);
+                KVStore.Reconnect(socketfd);
+                if(shared) KVStore.UseRing();
+
+                incoming = FrameBuffer();
+                Join(KVStore, socketfd, incoming, &cout);
+                if(!KVStore.Partitioned()) Sync(KVStore, socketfd, incoming, &cout);
+                drain();
                 continue;
             }
 
-            CMDStructure cmd = InputParser(buffer);
-            if(cmd.CMDEnum == ERROR) continue;
-
-            Response resp = KVStore.Handler(cmd);
-
-            cout << resp.value << '\n';
+            drain();
         }
     }
 
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// RESP2, the protocol redis speaks, as far as redis-cli and redis-benchmark need it. A request is
+// an array of bulk strings
+//
+//   *3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n
+//
+// or an inline line of words ("PING\r\n", what telnet sends). An answer is a simple string
+// (+OK), an error (-ERR ...), an integer (:1), a bulk string ($5\r\nvalue, $-1 when there is
+// none) or an array of answers. Clients pipeline: they send many requests before reading, so
+// Parse is called for one request at a time at the front of whatever has arrived.
+class Resp {
+public:
+    enum Status { DONE, PARTIAL, INVALID };
+
+    static constexpr size_t MAX_ARGUMENTS = 1 << 20;
+    static constexpr size_t MAX_BULK = 1 << 29;
+    static constexpr size_t MAX_INLINE = 1 << 16;
+
+private:
+    // the number on the line starting at at, moving at past the line
+    static Status Number(std::string_view input, size_t &at, int64_t &number) {
+        size_t end = input.find("\r\n", at);
+        if(end == std::string_view::npos) return input.size() - at > 32 ? INVALID : PARTIAL;
+
+        bool negative = input[at] == '-';
+        number = 0;
+        for(size_t i = at + negative; i < end; i ++) {
+            if(input[i] < '0' || input[i] > '9' || number > (INT64_MAX - 9) / 10) return INVALID;
+            number = number * 10 + input[i] - '0';
+        }
+        if(end == at + negative) return INVALID;
+        if(negative) number = -number;
+
+        at = end + 2;
+        return DONE;
+    }
+
+    static Status Inline(std::string_view input, std::vector<std::string_view> &args, size_t &used) {
+        size_t end = input.find('\n');
+        if(end == std::string_view::npos) return input.size() > MAX_INLINE ? INVALID : PARTIAL;
+
+        used = end + 1;
+        std::string_view line = input.substr(0, end > 0 && input[end - 1] == '\r' ? end - 1 : end);
+        while(!line.empty()) {
+            size_t start = line.find_first_not_of(' ');
+            if(start == std::string_view::npos) break;
+            line.remove_prefix(start);
+
+            size_t space = line.find(' ');
+            args.push_back(line.substr(0, space));
+            line.remove_prefix(space == std::string_view::npos ? line.size() : space);
+        }
+        return DONE;
+    }
+
+public:
+    // the request at the front of input, its arguments pointing into input and used set to its
+    // size; an empty inline line is a request without arguments
+    static Status Parse(std::string_view input, std::vector<std::string_view> &args, size_t &used) {
+        args.clear();
+        if(input.empty()) return PARTIAL;
+        if(input[0] != '*') return Inline(input, args, used);
+
+        size_t at = 1;
+        int64_t count;
+        Status status = Number(input, at, count);
+        if(status != DONE) return status;
+        if(count < 0 || (size_t)count > MAX_ARGUMENTS) return INVALID;
+
+        for(int64_t i = 0; i < count; i ++) {
+            if(at >= input.size()) return PARTIAL;
+            if(input[at] != '$') return INVALID;
+
+            int64_t size;
+            at ++;
+            if((status = Number(input, at, size)) != DONE) return status;
+            if(size < 0 || (size_t)size > MAX_BULK) return INVALID;
+
+            if(input.size() - at < (size_t)size + 2) return PARTIAL;
+            if(input[at + size] != '\r' || input[at + size + 1] != '\n') return INVALID;
+            args.push_back(input.substr(at, size));
+            at += size + 2;
+        }
+
+        used = at;
+        return DONE;
+    }
+
+    // answer encoders, append to out
+    static void Simple(std::string &out, std::string_view text) {
+        out.append("+").append(text).append("\r\n");
+    }
+
+    static void Error(std::string &out, std::string_view text) {
+        out.append("-").append(text).append("\r\n");
+    }
+
+    static void Integer(std::string &out, int64_t number) {
+        out.append(":").append(std::to_string(number)).append("\r\n");
+    }
+
+    static void Bulk(std::string &out, std::string_view text) {
+        out.append("$").append(std::to_string(text.size())).append("\r\n").append(text).append("\r\n");
+    }
+
+    static void Null(std::string &out) {
+        out.append("$-1\r\n");
+    }
+
+    // followed by count answers
+    static void Array(std::string &out, size_t count) {
+        out.append("*").append(std::to_string(count)).append("\r\n");
+    }
+};
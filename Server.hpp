@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "BufferQueue.hpp"
+#include "Frame.hpp"
+
+// Request/response server for a store this process owns. What the requests and responses look
+// like is up to the protocol it is given: Frames() takes frames holding an id and a command and
+// answers each with a frame holding the same id, OK or ERR and the command's answer, Resp.hpp
+// speaks the redis protocol. Either way a client can keep many requests in flight on one
+// connection, and a connection's answers come in the order its requests did.
+//
+// Every thread runs an edge-triggered epoll loop over the connections it accepted. They share the
+// listening socket with EPOLLEXCLUSIVE, so a new connection wakes one loop rather than all of
+// them. Whatever a read brings in is answered in one batch and written with one writev; a client
+// that sends faster than it reads stops being read once QUEUE_LIMIT bytes of answers wait for it.
+class Server {
+public:
+    // answers every whole request at the front of input, appending the answers to output; returns
+    // the bytes of input it took, or npos if the connection is to be closed once output is sent
+    using Protocol = std::function<size_t(std::string_view input, std::string &output)>;
+
+    // "OK <answer>" or "ERR <answer>" for a command
+    using Dispatch = std::function<std::string(const std::string &command)>;
+
+    static constexpr size_t QUEUE_LIMIT = 1 << 22;
+
+    static Protocol Frames(Dispatch dispatch) {
+        return [dispatch = std::move(dispatch)](std::string_view input, std::string &output) {
+            size_t used = 0;
+            uint32_t size;
+            while(input.size() - used >= sizeof(size)) {
+                memcpy(&size, input.data() + used, sizeof(size));
+                if(input.size() - used - sizeof(size) < size) break;
+
+                std::string request(input.substr(used + sizeof(size), size));
+                used += sizeof(size) + size;
+
+                size_t space = request.find(' ');
+                std::string id = request.substr(0, space);
+                output.append(Framed(id + " " + (space != std::string::npos ? dispatch(request.substr(space + 1)) : "ERR Missing command")));
+            }
+            return used;
+        };
+    }
+
+private:
+    struct Connection {
+        int fd;
+        bool stalled = false;   // input left unread until the answers drain
+        std::string in;         // the start of a request that hasn't all arrived
+        BufferQueue out;
+    };
+
+    class Loop {
+        Server &server;
+        int epollfd;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+        char chunk[1 << 16];
+
+        void Accept() {
+            while(true) {
+                int fd = accept4(server.listenfd, nullptr, nullptr, SOCK_NONBLOCK);
+                if(fd == -1) return;
+
+                auto conn = std::make_unique<Connection>();
+                conn->fd = fd;
+                epoll_event event = { EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, { .fd = fd } };
+                epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+                connections[fd] = std::move(conn);
+            }
+        }
+
+        void Close(Connection &conn) {
+            close(conn.fd);
+            connections.erase(conn.fd);
+        }
+
+        // false if the connection is gone
+        bool Flush(Connection &conn) {
+            while(!conn.out.Empty()) {
+                ssize_t bytes = conn.out.WriteTo(conn.fd);
+                if(bytes < 0 && errno == EAGAIN) break;
+                if(bytes <= 0) return false;
+            }
+            return true;
+        }
+
+        void Readable(Connection &conn) {
+            std::string batch;
+            while(true) {
+                // what arrives meanwhile waits in the socket, and then in the client
+                if(conn.out.Size() > QUEUE_LIMIT) {
+                    conn.stalled = true;
+                    return;
+                }
+
+                ssize_t bytes = read(conn.fd, chunk, sizeof(chunk));
+                if(bytes < 0 && errno == EAGAIN) return;
+                if(bytes <= 0) return Close(conn);
+
+                // the whole requests are answered straight from the chunk, only a partial one is kept
+                std::string_view input(chunk, bytes);
+                if(!conn.in.empty()) input = conn.in.append(chunk, bytes);
+                size_t used = server.protocol(input, batch);
+                bool done = used == std::string::npos;
+
+                if(!done) conn.in = std::string(input.substr(used));
+                if(!batch.empty()) conn.out.Push(std::make_shared<const std::string>(std::move(batch)));
+                batch.clear();
+                if(!Flush(conn) || done) return Close(conn);
+            }
+        }
+
+    public:
+        Loop(Server &server) : server(server) {
+            epollfd = epoll_create1(0);
+
+            epoll_event event = { EPOLLIN | EPOLLEXCLUSIVE, { .fd = server.listenfd } };
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, server.listenfd, &event);
+            event = { EPOLLIN, { .fd = server.stopfd } };
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, server.stopfd, &event);
+        }
+
+        ~Loop() {
+            for(auto &[fd, conn] : connections)
+                close(fd);
+            close(epollfd);
+        }
+
+        void Run() {
+            epoll_event events[256];
+            while(!server.stopped) {
+                int count = epoll_wait(epollfd, events, 256, -1);
+                for(int i = 0; i < count; i ++) {
+                    int fd = events[i].data.fd;
+                    if(fd == server.listenfd) {
+                        Accept();
+                        continue;
+                    }
+                    if(fd == server.stopfd) continue;
+
+                    auto it = connections.find(fd);
+                    if(it == connections.end()) continue;
+                    Connection &conn = *it->second;
+
+                    // edge-triggered, so input left unread while stalled is gone back to by hand
+                    bool resumed = false;
+                    if(events[i].events & EPOLLOUT) {
+                        if(!Flush(conn)) {
+                            Close(conn);
+                            continue;
+                        }
+                        if(conn.stalled && conn.out.Size() <= QUEUE_LIMIT / 2) {
+                            conn.stalled = false;
+                            resumed = true;
+                        }
+                    }
+                    if(!conn.stalled && (resumed || (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))) Readable(conn);
+                }
+            }
+        }
+    };
+
+    int listenfd, stopfd;
+    Protocol protocol;
+    std::atomic<bool> stopped { false };
+    std::vector<std::unique_ptr<Loop>> loops;
+
+public:
+    Server(int listenfd, Protocol protocol, size_t threads = 1) : listenfd(listenfd), protocol(std::move(protocol)) {
+        fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+        stopfd = eventfd(0, EFD_NONBLOCK);
+        for(size_t i = 0; i < std::max<size_t>(threads, 1); i ++)
+            loops.push_back(std::make_unique<Loop>(*this));
+    }
+
+    ~Server() {
+        loops.clear();
+        close(stopfd);
+    }
+
+    // serves until Stop
+    void Run() {
+        std::vector<std::thread> threads;
+        for(size_t i = 1; i < loops.size(); i ++)
+            threads.emplace_back(&Loop::Run, loops[i].get());
+        loops[0]->Run();
+
+        for(auto &thread : threads)
+            thread.join();
+    }
+
+    // from any thread; stopfd stays readable, so it wakes every loop
+    void Stop() {
+        stopped = true;
+        uint64_t one = 1;
+        write(stopfd, &one, sizeof(one));
+    }
+};
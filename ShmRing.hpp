@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Byte queue with one producer and one consumer, in memory shared by two processes on one host:
+// a memfd that is either mapped before they fork or handed to the other process over a unix
+// socket, along with two eventfds (Fds and Open). Passing bytes takes no system call while the
+// consumer keeps up, the producer copies them in and publishes the new head and the consumer
+// copies them out and publishes the new tail. Either end can sleep: Write wakes a consumer that
+// had emptied the ring through Wakeup, Read wakes a producer waiting in WriteAll for room.
+class ShmRing {
+    struct Header {
+        alignas(64) std::atomic<uint64_t> head { 0 };   // bytes written so far
+        alignas(64) std::atomic<uint64_t> tail { 0 };   // bytes read so far
+        alignas(64) std::atomic<bool> waiting { false };    // the producer sleeps until Read makes room
+    };
+
+    Header *header = nullptr;
+    char *data = nullptr;
+    size_t capacity = 1;
+    int memfd = -1, readerfd = -1, writerfd = -1;
+
+    ShmRing() = default;
+
+    bool Map() {
+        void *memory = mmap(nullptr, sizeof(Header) + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if(memory == MAP_FAILED) return false;
+        header = (Header *)memory;
+        data = (char *)memory + sizeof(Header);
+        return true;
+    }
+
+    static void Signal(int fd) {
+        uint64_t one = 1;
+        write(fd, &one, sizeof(one));
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    explicit ShmRing(size_t size) {
+        while(capacity < size) capacity <<= 1;
+
+        memfd = memfd_create("kvstore-ring", MFD_CLOEXEC);
+        readerfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        writerfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(memfd == -1 || readerfd == -1 || writerfd == -1 || ftruncate(memfd, sizeof(Header) + capacity) == -1 || !Map())
+            throw std::bad_alloc();
+        new (header) Header();
+    }
+
+    // the other end of a ring from its Fds, which it takes over; nullptr if they aren't one
+    static std::unique_ptr<ShmRing> Open(const int fds[3]) {
+        std::unique_ptr<ShmRing> ring(new ShmRing());
+        ring->memfd = fds[0];
+        ring->readerfd = fds[1];
+        ring->writerfd = fds[2];
+
+        struct stat info;
+        if(fstat(ring->memfd, &info) == -1 || (size_t)info.st_size <= sizeof(Header)) return nullptr;
+        ring->capacity = info.st_size - sizeof(Header);
+        if((ring->capacity & (ring->capacity - 1)) != 0 || !ring->Map()) return nullptr;
+        return ring;
+    }
+
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    ~ShmRing() {
+        if(header) munmap(header, sizeof(Header) + capacity);
+        for(int fd : { memfd, readerfd, writerfd })
+            if(fd != -1) close(fd);
+    }
+
+    // the memfd and the eventfds, to hand to the other process
+    void Fds(int fds[3]) const {
+        fds[0] = memfd;
+        fds[1] = readerfd;
+        fds[2] = writerfd;
+    }
+
+    size_t Capacity() const { return capacity; }
+
+    // readable once Write has put bytes in a ring the consumer had emptied; Clear it before
+    // reading the ring empty again
+    int Wakeup() const { return readerfd; }
+
+    void Clear() {
+        uint64_t count;
+        read(readerfd, &count, sizeof(count));
+    }
+
+    // the consumer's way to sleep until there is something to Read
+    void Wait() {
+        pollfd event = { readerfd, POLLIN, 0 };
+        poll(&event, 1, -1);
+        Clear();
+    }
+
+    // all of bytes or, if they don't fit yet, nothing
+    bool Write(const void *bytes, size_t size) {
+        uint64_t head = header->head.load(std::memory_order_relaxed);
+        if(head + size - header->tail.load() > capacity) return false;
+
+        size_t at = head & (capacity - 1), first = std::min(size, capacity - at);
+        memcpy(data + at, bytes, first);
+        memcpy(data, (const char *)bytes + first, size - first);
+
+        // a consumer that had read everything before these may be asleep
+        header->head.store(head + size);
+        if(header->tail.load() == head) Signal(readerfd);
+        return true;
+    }
+
+    // all of bytes, in pieces as room is made for them; false if the peer hangs up on the socket
+    // hangup meanwhile
+    bool WriteAll(const void *bytes, size_t size, int hangup) {
+        for(size_t done = 0; done < size; ) {
+            size_t piece = std::min(size - done, capacity);
+            if(Write((const char *)bytes + done, piece)) {
+                done += piece;
+                continue;
+            }
+
+            // room made before we said we wait wouldn't wake us
+            header->waiting = true;
+            if(Write((const char *)bytes + done, piece)) {
+                done += piece;
+                continue;
+            }
+
+            pollfd events[2] = { { writerfd, POLLIN, 0 }, { hangup, POLLRDHUP, 0 } };
+            poll(events, 2, -1);
+            if(events[1].revents != 0) return false;
+
+            uint64_t count;
+            read(writerfd, &count, sizeof(count));
+        }
+        return true;
+    }
+
+    // up to size bytes, 0 if there is nothing to read
+    size_t Read(void *bytes, size_t size) {
+        uint64_t tail = header->tail.load(std::memory_order_relaxed);
+        size = std::min<size_t>(size, header->head.load() - tail);
+        if(size == 0) return 0;
+
+        size_t at = tail & (capacity - 1), first = std::min(size, capacity - at);
+        memcpy(bytes, data + at, first);
+        memcpy((char *)bytes + first, data, size - first);
+
+        header->tail.store(tail + size);
+        if(header->waiting.exchange(false)) Signal(writerfd);
+        return size;
+    }
+};
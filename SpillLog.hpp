@@ -0,0 +1,297 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+#include "BloomFilter.hpp"
+#include "FlatIndex.hpp"
+
+// Bitcask style storage for the pairs that don't fit in memory. Records are only ever appended
+// to a single data file and an in-memory keydir maps each key to its latest value, so a write is
+// one sequential append and a read is one positioned read. Deletes append a tombstone.
+//
+// A bloom filter of the keys sits in front of the keydir, so the common case of a key that was
+// never spilled is answered without probing the keydir.
+//
+// Levels follow the store's PUSH / POP: a new level starts at the current end of the file and
+// every keydir change after it is logged with the location it replaced. Popping the level replays
+// the log backwards and truncates the file back to where the level started; the restored
+// locations all lie below that point. Keys of a popped level left in the filter only cost false
+// positives.
+//
+// A forked copy of the store reads the same file through its own descriptor. Appends and
+// compaction (which writes a new file) leave what it reads alone; popping a level doesn't truncate
+// while such a copy exists.
+class SpillLog {
+public:
+    struct Location {
+        uint64_t offset;
+        uint32_t size;
+    };
+
+private:
+    enum RecordType : uint8_t { VALUE = 1, TOMBSTONE = 2 };
+
+    // type, key size, value size
+    static constexpr size_t HEADER = 1 + 4 + 4;
+    // below this much garbage the file is never rewritten
+    static constexpr uint64_t COMPACT_MIN = 1 << 20;
+
+    // a keydir entry as it was before a change, found is false if the key wasn't there
+    struct Undo {
+        std::string key;
+        bool found;
+        Location loc;
+    };
+
+    struct Level {
+        uint64_t start, live;
+        size_t undo;
+    };
+
+    std::string path;
+    int fd;
+    uint64_t tail = 0, live = 0;
+    FlatIndex<std::string, Location> keydir;
+    BloomFilter filter;
+    std::vector<Level> saves;
+    std::vector<Undo> undo;
+
+    static uint64_t RecordSize(const std::string &key, uint32_t size) {
+        return HEADER + key.size() + size;
+    }
+
+    static void WriteFully(int fd, iovec *iov, int count, uint64_t offset) {
+        while(count > 0) {
+            ssize_t bytes = pwritev(fd, iov, count, offset);
+            assert(bytes > 0);
+            offset += bytes;
+
+            for(; count > 0 && (size_t)bytes >= iov->iov_len; iov ++, count --)
+                bytes -= iov->iov_len;
+            if(count > 0) {
+                iov->iov_base = (char *)iov->iov_base + bytes;
+                iov->iov_len -= bytes;
+            }
+        }
+    }
+
+    static void Encode(char *header, RecordType type, uint32_t keySize, uint32_t valueSize) {
+        header[0] = type;
+        memcpy(header + 1, &keySize, 4);
+        memcpy(header + 5, &valueSize, 4);
+    }
+
+    // returns the offset of the value inside the file
+    uint64_t Append(RecordType type, const std::string &key, const char *value, uint32_t size) {
+        char header[HEADER];
+        Encode(header, type, key.size(), size);
+
+        iovec iov[3] = {
+            { header, HEADER },
+            { (void *)key.data(), key.size() },
+            { (void *)value, size }
+        };
+        WriteFully(fd, iov, size ? 3 : 2, tail);
+
+        uint64_t offset = tail + HEADER + key.size();
+        tail += RecordSize(key, size);
+        return offset;
+    }
+
+    bool ReadAt(Location loc, std::string &value) const {
+        value.resize(loc.size);
+        for(uint32_t done = 0; done < loc.size; ) {
+            ssize_t bytes = pread(fd, &value[done], loc.size - done, loc.offset + done);
+            if(bytes <= 0) return false;
+            done += bytes;
+        }
+        return true;
+    }
+
+    // rewrites the live records into a fresh file, dropping overwritten values and tombstones;
+    // the caller makes sure no saved level points into the old file
+    void Compact() {
+        std::string compactPath = path + ".compact";
+        int compactfd = open(compactPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        assert(compactfd != -1);
+
+        std::string buffer, value;
+        uint64_t offset = 0;
+        for(auto &[key, loc] : keydir) {
+            ReadAt(loc, value);
+
+            char header[HEADER];
+            Encode(header, VALUE, key.size(), value.size());
+            buffer.append(header, HEADER).append(key).append(value);
+
+            loc.offset = offset + HEADER + key.size();
+            offset += RecordSize(key, value.size());
+
+            if(buffer.size() >= (1 << 16)) {
+                iovec iov = { buffer.data(), buffer.size() };
+                WriteFully(compactfd, &iov, 1, offset - buffer.size());
+                buffer.clear();
+            }
+        }
+        if(!buffer.empty()) {
+            iovec iov = { buffer.data(), buffer.size() };
+            WriteFully(compactfd, &iov, 1, offset - buffer.size());
+        }
+
+        rename(compactPath.c_str(), path.c_str());
+        close(fd);
+        fd = compactfd;
+        tail = live = offset;
+    }
+
+    // erased keys stay in the filter, start over from the keydir once it is overfull; keys a
+    // saved level would bring back are kept too
+    void AddToFilter(const std::string &key) {
+        filter.Add(key);
+        if(!filter.Saturated()) return;
+
+        filter.Reset(2 * (keydir.size() + undo.size()));
+        for(auto &entry : keydir)
+            filter.Add(entry.first);
+        for(auto &entry : undo)
+            if(entry.found) filter.Add(entry.key);
+    }
+
+    void Record(const std::string &key) {
+        if(saves.empty()) return;
+
+        auto it = keydir.find(key);
+        if(it != keydir.end()) undo.push_back({ key, true, it->second });
+        else undo.push_back({ key, false, {} });
+    }
+
+    // once most of the file is garbage, unless a saved level still points into it
+    void MaybeCompact() {
+        if(saves.empty() && tail - live > COMPACT_MIN && tail - live > live)
+            Compact();
+    }
+
+public:
+    explicit SpillLog(std::string filepath) : path(std::move(filepath)) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        assert(fd != -1);
+        filter.Reset(1024);
+    }
+
+    SpillLog(const SpillLog &) = delete;
+    SpillLog &operator =(const SpillLog &) = delete;
+
+    ~SpillLog() {
+        close(fd);
+        unlink(path.c_str());
+    }
+
+    const std::string &Path() const { return path; }
+    size_t Count() const { return keydir.size(); }
+    bool MayContain(std::string_view key) const { return filter.MayContain(key); }
+    bool Contains(const std::string &key) const { return MayContain(key) && keydir.contains(key); }
+
+    bool Get(const std::string &key, std::string &value) const {
+        if(!filter.MayContain(key)) return false;
+
+        auto it = keydir.find(key);
+        return it != keydir.end() && ReadAt(it->second, value);
+    }
+
+    void Put(const std::string &key, const std::string &value) {
+        Record(key);
+        Location loc = { Append(VALUE, key, value.data(), value.size()), (uint32_t)value.size() };
+
+        auto it = keydir.find(key);
+        if(it != keydir.end()) {
+            live -= RecordSize(key, it->second.size);
+            it->second = loc;
+        } else {
+            keydir[key] = loc;
+            AddToFilter(key);
+        }
+        live += RecordSize(key, value.size());
+
+        MaybeCompact();
+    }
+
+    bool Erase(const std::string &key) {
+        if(!filter.MayContain(key)) return false;
+
+        auto it = keydir.find(key);
+        if(it == keydir.end()) return false;
+
+        Record(key);
+        live -= RecordSize(key, it->second.size);
+        keydir.erase(it);
+        Append(TOMBSTONE, key, nullptr, 0);
+
+        MaybeCompact();
+        return true;
+    }
+
+    // calls f(key, value) for every pair, one positioned read each
+    template<class F>
+    void ForEach(F &&f) const {
+        std::string value;
+        for(auto &[key, loc] : keydir)
+            if(ReadAt(loc, value)) f(key, value);
+    }
+
+    // same for the pairs as they were on a level, 0 is the bottom of the stack; the oldest
+    // logged entry of a key changed since the level was saved is what the level had
+    template<class F>
+    void ForEachAt(size_t level, F &&f) const {
+        if(level == saves.size()) return ForEach(std::forward<F>(f));
+
+        FlatIndex<std::string, const Undo *> changed;
+        for(size_t i = saves[level].undo; i < undo.size(); i ++)
+            if(!changed.contains(undo[i].key)) changed[undo[i].key] = &undo[i];
+
+        std::string value;
+        for(auto &[key, loc] : keydir)
+            if(!changed.contains(key) && ReadAt(loc, value)) f(key, value);
+        for(auto &[key, entry] : changed)
+            if(entry->found && ReadAt(entry->loc, value)) f(key, value);
+    }
+
+    size_t Levels() const { return saves.size() + 1; }
+
+    void Push() {
+        saves.push_back({ tail, live, undo.size() });
+    }
+
+    // with rewind off the popped level's records stay in the file as garbage, for a snapshot of
+    // the store that may still read them
+    void Pop(bool rewind = true) {
+        assert(!saves.empty());
+        Level level = saves.back();
+        saves.pop_back();
+
+        for(size_t i = undo.size(); i -- > level.undo; ) {
+            if(undo[i].found) keydir[undo[i].key] = undo[i].loc;
+            else keydir.erase(undo[i].key);
+        }
+        undo.resize(level.undo);
+
+        live = level.live;
+        if(!rewind) return;
+
+        tail = level.start;
+        ftruncate(fd, tail);
+    }
+
+    // drops the saved levels and keeps the top one (DELETESAVES)
+    void Flatten() {
+        saves.clear();
+        undo.clear();
+    }
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "Frame.hpp"
+
+// Binary stream a SYNC sends the store in. The stream is a series of frames (Frame.hpp) of
+// records:
+//
+//   PAIR      type, key size (4), value size (4), deadline (8), key, value
+//   ERASE     type, key size (4), key
+//   LEVEL     type             the pairs after it make up the next saved level, which starts empty
+//   PUSH      type             a PUSH / POP / DELETESAVES as it happened
+//   POP       type
+//   FLATTEN   type
+//   RESET     type             drop every pair and saved level, a full copy follows
+//   POSITION  type, replication id (8), offset (8)
+//   START     type, offset (8) the offset the mutations after it follow on from
+//   END       type             last record of the stream, sent in a frame of its own
+//
+// A full copy is RESET followed by the pairs of every level split by LEVEL; an incremental one is
+// START followed by the recorded mutations a peer missed (PAIR, ERASE, PUSH, POP, FLATTEN). Both
+// end with the POSITION the receiver is at afterwards.
+//
+// Deadlines are absolute milliseconds on the wall clock, so the time a pair spends in transit
+// comes off its TTL. Records are batched into frames of about FRAME bytes and every frame is
+// written with a single call.
+
+class SyncStream {
+public:
+    enum RecordType : uint8_t { PAIR = 1, LEVEL = 2, END = 4, ERASE = 5, PUSH = 6, POP = 7, FLATTEN = 8, RESET = 9, POSITION = 10, START = 11 };
+
+    static constexpr size_t FRAME = 1 << 16;
+
+    // record encoders, append to buffer
+    static void Pair(std::string &buffer, std::string_view key, std::string_view value, uint64_t deadline) {
+        char header[1 + 4 + 4 + 8];
+        uint32_t keySize = key.size(), valueSize = value.size();
+        header[0] = PAIR;
+        memcpy(header + 1, &keySize, 4);
+        memcpy(header + 5, &valueSize, 4);
+        memcpy(header + 9, &deadline, 8);
+        buffer.append(header, sizeof(header)).append(key).append(value);
+    }
+
+    static void Erase(std::string &buffer, std::string_view key) {
+        char header[1 + 4];
+        uint32_t keySize = key.size();
+        header[0] = ERASE;
+        memcpy(header + 1, &keySize, 4);
+        buffer.append(header, sizeof(header)).append(key);
+    }
+
+    static void Position(std::string &buffer, uint64_t id, uint64_t offset) {
+        char record[1 + 8 + 8];
+        record[0] = POSITION;
+        memcpy(record + 1, &id, 8);
+        memcpy(record + 9, &offset, 8);
+        buffer.append(record, sizeof(record));
+    }
+
+    static void Start(std::string &buffer, uint64_t offset) {
+        char record[1 + 8];
+        record[0] = START;
+        memcpy(record + 1, &offset, 8);
+        buffer.append(record, sizeof(record));
+    }
+
+    // records without fields
+    static void Mark(std::string &buffer, RecordType type) {
+        buffer.push_back(type);
+    }
+
+    // the size prefix of the frame being built is filled in on Flush
+    class Writer {
+        int fd;
+        std::string buffer = std::string(4, '\0');
+
+    public:
+        explicit Writer(int fd) : fd(fd) {}
+
+        void Pair(const std::string &key, const std::string &value, uint64_t deadline) {
+            SyncStream::Pair(buffer, key, value, deadline);
+            if(buffer.size() >= FRAME) Flush();
+        }
+
+        void Position(uint64_t id, uint64_t offset) { SyncStream::Position(buffer, id, offset); }
+        void Start(uint64_t offset) { SyncStream::Start(buffer, offset); }
+        void Mark(RecordType type) { SyncStream::Mark(buffer, type); }
+
+        // records encoded beforehand
+        void Append(const std::string &records) {
+            buffer.append(records);
+            if(buffer.size() >= FRAME) Flush();
+        }
+
+        void Flush() {
+            if(buffer.size() == 4) return;
+
+            uint32_t size = buffer.size() - 4;
+            memcpy(&buffer[0], &size, 4);
+            WriteFully(fd, buffer.data(), buffer.size());
+            buffer.resize(4);
+        }
+
+        void End() {
+            Flush();
+            buffer.push_back(END);
+            Flush();
+        }
+    };
+
+    // whether frame is the one End sends
+    static bool Ended(const std::string &frame) {
+        return frame.size() == 1 && uint8_t(frame[0]) == END;
+    }
+
+    // hands the records of a frame to the visitor: Pair(key, value, deadline), Erase(key),
+    // Position(id, offset), Start(offset) and Mark(type) for the rest; false at END or on a
+    // malformed frame
+    template<class V>
+    static bool Parse(const std::string &frame, V &visitor) {
+        std::string key, value;
+        for(size_t pos = 0; pos < frame.size(); ) {
+            uint8_t type = frame[pos ++];
+            size_t left = frame.size() - pos;
+            uint32_t keySize, valueSize;
+            uint64_t number[2];
+
+            switch(type) {
+                case PAIR:
+                    if(left < 16) return false;
+                    memcpy(&keySize, &frame[pos], 4);
+                    memcpy(&valueSize, &frame[pos + 4], 4);
+                    memcpy(number, &frame[pos + 8], 8);
+                    pos += 16;
+                    if(frame.size() - pos < (uint64_t)keySize + valueSize) return false;
+
+                    key.assign(frame, pos, keySize);
+                    value.assign(frame, pos + keySize, valueSize);
+                    pos += keySize + valueSize;
+                    visitor.Pair(key, value, number[0]);
+                    break;
+                case ERASE:
+                    if(left < 4) return false;
+                    memcpy(&keySize, &frame[pos], 4);
+                    pos += 4;
+                    if(frame.size() - pos < keySize) return false;
+
+                    key.assign(frame, pos, keySize);
+                    pos += keySize;
+                    visitor.Erase(key);
+                    break;
+                case POSITION:
+                    if(left < 16) return false;
+                    memcpy(number, &frame[pos], 16);
+                    pos += 16;
+                    visitor.Position(number[0], number[1]);
+                    break;
+                case START:
+                    if(left < 8) return false;
+                    memcpy(number, &frame[pos], 8);
+                    pos += 8;
+                    visitor.Start(number[0]);
+                    break;
+                case LEVEL: case PUSH: case POP: case FLATTEN: case RESET:
+                    visitor.Mark(RecordType(type));
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+};
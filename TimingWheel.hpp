@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "FlatIndex.hpp"
+
+// Hierarchical timing wheel. Level l has 64 slots of 64^l ticks each; an entry sits on the
+// lowest level where its expiry and the current tick agree on every higher digit, and moves
+// one level down whenever the wheel enters the slot it sits in. Entries past the last level
+// wait on an overflow list until the top level wraps around.
+//
+// Insert and Cancel are O(1). Advance jumps straight to the next occupied slot using one
+// occupancy bitmap per level, so idle stretches cost nothing.
+//
+// Nodes live in a vector and link to each other by index; freed nodes go on a free list and
+// are reused, so a steady stream of inserts and expiries allocates nothing.
+template<class T>
+class TimingWheel {
+public:
+    struct Handle {
+        uint32_t index = NIL, generation = 0;
+    };
+
+    static constexpr uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+
+private:
+    static constexpr uint32_t NIL = std::numeric_limits<uint32_t>::max();
+    static constexpr int BITS = 6, SLOTS = 1 << BITS, LEVELS = 6;
+    static constexpr int OVERFLOW = LEVELS * SLOTS;
+
+    struct Node {
+        T value;
+        uint64_t expires;
+        uint32_t prev, next, generation = 0;
+        int slot;   // level * SLOTS + slot, OVERFLOW, or -1 when free
+    };
+
+    std::vector<Node> nodes;
+    std::array<uint32_t, OVERFLOW + 1> heads;
+    std::array<uint64_t, LEVELS> occupied = {};
+    uint32_t freeList = NIL;
+    uint64_t now;
+    size_t count = 0;
+
+    static uint64_t Span(int level) { return uint64_t(1) << (BITS * level); }
+    static int Digit(uint64_t tick, int level) { return (tick >> (BITS * level)) & (SLOTS - 1); }
+
+    void Link(uint32_t i) {
+        Node &node = nodes[i];
+        uint64_t expires = std::max(node.expires, now);
+        uint64_t diff = expires ^ now;
+
+        int level = 0;
+        while(level < LEVELS && diff >= Span(level + 1)) level ++;
+
+        node.slot = level == LEVELS ? OVERFLOW : level * SLOTS + Digit(expires, level);
+        node.prev = NIL;
+        node.next = heads[node.slot];
+        if(node.next != NIL) nodes[node.next].prev = i;
+        heads[node.slot] = i;
+
+        if(level < LEVELS) occupied[level] |= uint64_t(1) << Digit(expires, level);
+    }
+
+    void Unlink(uint32_t i) {
+        Node &node = nodes[i];
+        if(node.prev != NIL) nodes[node.prev].next = node.next;
+        else heads[node.slot] = node.next;
+        if(node.next != NIL) nodes[node.next].prev = node.prev;
+
+        if(node.slot != OVERFLOW && heads[node.slot] == NIL)
+            occupied[node.slot / SLOTS] &= ~(uint64_t(1) << (node.slot % SLOTS));
+    }
+
+    void Free(uint32_t i) {
+        nodes[i].slot = -1;
+        nodes[i].generation ++;
+        nodes[i].next = freeList;
+        freeList = i;
+        count --;
+    }
+
+    // moves everything in a slot to wherever it belongs relative to the current tick
+    void Cascade(int slot) {
+        uint32_t i = heads[slot];
+        heads[slot] = NIL;
+        if(slot != OVERFLOW) occupied[slot / SLOTS] &= ~(uint64_t(1) << (slot % SLOTS));
+
+        while(i != NIL) {
+            uint32_t next = nodes[i].next;
+            Link(i);
+            i = next;
+        }
+    }
+
+    // first tick >= now at which a slot expires or has to be cascaded
+    uint64_t NextEvent() const {
+        uint64_t best = NEVER;
+        for(int level = 0; level < LEVELS; level ++) {
+            // a higher level slot is only visited when the wheel enters it, at its first tick
+            int from = Digit(now, level) + (level > 0 && (now & (Span(level) - 1)) != 0);
+            uint64_t pending = from < SLOTS ? occupied[level] >> from << from : 0;
+            if(!pending) continue;
+
+            uint64_t base = now >> (BITS * (level + 1)) << (BITS * (level + 1));
+            best = std::min(best, base + __builtin_ctzll(pending) * Span(level));
+        }
+
+        if(heads[OVERFLOW] != NIL)
+            best = std::min(best, ((now >> (BITS * LEVELS)) + 1) << (BITS * LEVELS));
+        return best;
+    }
+
+public:
+    explicit TimingWheel(uint64_t start = 0) : now(start) {
+        heads.fill(NIL);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    uint64_t Now() const { return now; }
+
+    // entries already due expire on the next Advance
+    Handle Insert(T value, uint64_t expires) {
+        uint32_t i = freeList;
+        if(i != NIL) freeList = nodes[i].next;
+        else {
+            i = nodes.size();
+            nodes.emplace_back();
+        }
+
+        nodes[i].value = std::move(value);
+        nodes[i].expires = expires;
+        Link(i);
+        count ++;
+        return { i, nodes[i].generation };
+    }
+
+    // false if the entry already expired or was cancelled
+    bool Cancel(Handle handle) {
+        if(handle.index >= nodes.size()) return false;
+        Node &node = nodes[handle.index];
+        if(node.slot < 0 || node.generation != handle.generation) return false;
+
+        Unlink(handle.index);
+        Free(handle.index);
+        return true;
+    }
+
+    // first tick something is due, NEVER when the wheel is empty
+    uint64_t NextExpiry() const {
+        return count ? NextEvent() : NEVER;
+    }
+
+    // expires the entries due at or before tick, appending at most limit of them to expired;
+    // returns false if some due entries were left for the next call
+    bool Advance(uint64_t tick, std::vector<std::pair<T, uint64_t>> &expired, size_t limit = std::numeric_limits<size_t>::max()) {
+        while(count) {
+            uint64_t next = NextEvent();
+            if(next > tick) break;
+            now = next;
+
+            // cascading again after stopping halfway through a tick finds the slots already empty
+            if((now & (Span(LEVELS) - 1)) == 0) Cascade(OVERFLOW);
+            for(int level = LEVELS - 1; level > 0; level --)
+                if((now & (Span(level) - 1)) == 0) Cascade(level * SLOTS + Digit(now, level));
+
+            int slot = Digit(now, 0);
+            while(heads[slot] != NIL) {
+                if(limit == 0) return false;
+                limit --;
+
+                uint32_t i = heads[slot];
+                Unlink(i);
+                expired.emplace_back(std::move(nodes[i].value), nodes[i].expires);
+                Free(i);
+            }
+
+            now ++;
+        }
+        now = std::max(now, tick + 1);
+        return true;
+    }
+
+    uint64_t Expires(Handle handle) const {
+        return nodes[handle.index].expires;
+    }
+
+    // calls f(value, expires) for every pending entry
+    template<class F>
+    void ForEach(F &&f) const {
+        for(auto &node : nodes)
+            if(node.slot >= 0) f(node.value, node.expires);
+    }
+
+    void clear() {
+        nodes.clear();
+        heads.fill(NIL);
+        occupied.fill(0);
+        freeList = NIL;
+        count = 0;
+    }
+};
+
+// One deadline per key on top of a TimingWheel. Scheduling a key again cancels its previous
+// deadline, so the wheel never holds more entries than there are keys and an outdated
+// deadline can't fire for a key that was set again since.
+template<class K>
+class ExpiryIndex {
+    using Handle = typename TimingWheel<K>::Handle;
+
+    TimingWheel<K> wheel;
+    FlatIndex<K, Handle> handles;
+
+public:
+    explicit ExpiryIndex(uint64_t start = 0) : wheel(start) {}
+
+    size_t size() const { return handles.size(); }
+    bool empty() const { return handles.empty(); }
+    uint64_t NextExpiry() const { return wheel.NextExpiry(); }
+
+    void Schedule(const K &key, uint64_t deadline) {
+        auto it = handles.find(key);
+        if(it != handles.end()) {
+            wheel.Cancel(it->second);
+            it->second = wheel.Insert(key, deadline);
+        } else handles[key] = wheel.Insert(key, deadline);
+    }
+
+    bool Cancel(const K &key) {
+        auto it = handles.find(key);
+        if(it == handles.end()) return false;
+
+        wheel.Cancel(it->second);
+        handles.erase(it);
+        return true;
+    }
+
+    // NEVER for keys without a deadline
+    uint64_t Deadline(const K &key) const {
+        auto it = handles.find(key);
+        return it != handles.end() ? wheel.Expires(it->second) : TimingWheel<K>::NEVER;
+    }
+
+    bool Advance(uint64_t tick, std::vector<std::pair<K, uint64_t>> &expired, size_t limit = std::numeric_limits<size_t>::max()) {
+        size_t first = expired.size();
+        bool done = wheel.Advance(tick, expired, limit);
+        for(size_t i = first; i < expired.size(); i ++)
+            handles.erase(expired[i].first);
+        return done;
+    }
+
+    // calls f(key, deadline) for every key
+    template<class F>
+    void ForEach(F &&f) const {
+        wheel.ForEach(std::forward<F>(f));
+    }
+
+    void clear() {
+        wheel.clear();
+        handles.clear();
+    }
+};
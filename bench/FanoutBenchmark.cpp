@@ -0,0 +1,111 @@
+// Cost of broadcasting through the hub against the number of subscribers and the message size.
+// One publisher sends messages that the hub passes on to every other client; the hub's CPU time
+// per message is what queueing and writing the copies costs it, spread over its event loops.
+// g++ -O2 -pthread -o fanout_bench bench/FanoutBenchmark.cpp && ./fanout_bench [messages] [threads]
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <vector>
+#include "../Hub.hpp"
+
+using namespace std;
+
+sockaddr_in hubAddr;
+
+int Connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1 || connect(fd, (sockaddr *)&hubAddr, sizeof(hubAddr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+// drains every subscriber until each got bytes
+void Drain(const vector<int> &subscribers, size_t bytes) {
+    int epollfd = epoll_create1(0);
+    vector<size_t> got(subscribers.size());
+    for(size_t i = 0; i < subscribers.size(); i ++) {
+        fcntl(subscribers[i], F_SETFL, O_NONBLOCK);
+        epoll_event event = { EPOLLIN | EPOLLET, { .u64 = i } };
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, subscribers[i], &event);
+    }
+
+    static char chunk[1 << 16];
+    epoll_event events[256];
+    for(size_t done = 0; done < subscribers.size(); ) {
+        int count = epoll_wait(epollfd, events, 256, -1);
+        for(int i = 0; i < count; i ++) {
+            size_t at = events[i].data.u64;
+            ssize_t read;
+            while((read = ::read(subscribers[at], chunk, sizeof(chunk))) > 0)
+                if((got[at] += read) == bytes) done ++;
+        }
+    }
+    close(epollfd);
+}
+
+int main(int argc, char **argv) {
+    int most = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t threads = argc > 2 ? atoi(argv[2]) : 1;
+
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    printf("%12s %8s %10s %12s %16s\n", "subscribers", "size", "messages", "us/message", "hub cpu us/msg");
+    for(int subscribers : { 10, 100, 1000 })
+        for(size_t size : { 64, 1024, 16384 }) {
+            // about 256 MB delivered per run at most
+            int messages = min<size_t>(most, max<size_t>(10, (256 << 20) / (subscribers * size)));
+
+            int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+            hubAddr = {};
+            hubAddr.sin_family = AF_INET;
+            hubAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+            socklen_t len = sizeof(hubAddr);
+            if(bind(listenfd, (sockaddr *)&hubAddr, len) == -1 || listen(listenfd, SOMAXCONN) == -1) {
+                perror("listen");
+                return 1;
+            }
+            getsockname(listenfd, (sockaddr *)&hubAddr, &len);
+
+            // backpressure, so a subscriber that falls behind slows the publisher instead of
+            // losing messages
+            pid_t pid = fork();
+            if(pid == 0) {
+                Hub(listenfd, fopen("/dev/null", "w"), Hub::QUEUE_LIMIT, Hub::BACKPRESSURE, threads).Run();
+                _exit(0);
+            }
+            close(listenfd);
+
+            int publisher = Connect();
+            vector<int> fds;
+            for(int i = 0; i < subscribers; i ++)
+                fds.push_back(Connect());
+            usleep(200000);
+
+            string frame = Framed(string(size, 'x'));
+            auto start = chrono::steady_clock::now();
+            thread drainer(Drain, cref(fds), frame.size() * messages);
+            for(int i = 0; i < messages; i ++)
+                WriteFully(publisher, frame.data(), frame.size());
+            drainer.join();
+            auto end = chrono::steady_clock::now();
+
+            close(publisher);
+            for(int fd : fds) close(fd);
+
+            rusage usage;
+            wait4(pid, nullptr, 0, &usage);
+            double cpu = usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+
+            printf("%12d %8zu %10d %12.2f %16.2f\n", subscribers, size, messages, chrono::duration<double, micro>(end - start).count() / messages, cpu / messages);
+        }
+}
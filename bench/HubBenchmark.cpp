@@ -0,0 +1,99 @@
+// Cost of one hub event against the number of connected clients. One connection streams to one
+// client the way a SYNC does and small pings go through the hub while more and more idle clients
+// are connected; with select the cost would grow with the highest descriptor.
+// g++ -O2 -pthread -o hub_bench bench/HubBenchmark.cpp && ./hub_bench [pings]
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vector>
+#include "../Hub.hpp"
+
+using namespace std;
+
+sockaddr_in hubAddr;
+
+int Connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1 || connect(fd, (sockaddr *)&hubAddr, sizeof(hubAddr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    int pings = argc > 1 ? atoi(argv[1]) : 20000;
+
+    // the hub and this process each hold one descriptor per client
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    int most = min<rlim_t>(limit.rlim_cur - 64, 10000);
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    hubAddr = {};
+    hubAddr.sin_family = AF_INET;
+    hubAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    socklen_t len = sizeof(hubAddr);
+    if(bind(listenfd, (sockaddr *)&hubAddr, len) == -1 || listen(listenfd, SOMAXCONN) == -1) {
+        perror("listen");
+        return 1;
+    }
+    getsockname(listenfd, (sockaddr *)&hubAddr, &len);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        Hub(listenfd, fopen("/dev/null", "w")).Run();
+        _exit(0);
+    }
+    close(listenfd);
+
+    // syncer and target connect first, so the syncer is the only client the request can go to
+    int syncer = Connect(), target = Connect();
+    usleep(100000);
+
+    string found, request, ack;
+    WriteFrame(target, "SYNC 0 0");
+    ReadFrame(syncer, request);
+    int targetfd = atoi(strrchr(request.c_str(), ' ') + 1);
+
+    // the target hears that a stream follows once the stream connects
+    int stream = Connect();
+    WriteFrame(stream, "STREAM " + to_string(targetfd));
+    ReadFrame(stream, ack);
+    ReadFrame(target, found);
+
+    printf("%10s %14s\n", "clients", "us/event");
+    vector<int> idle;
+    for(int clients : { 10, 100, 1000, 5000, 10000 }) {
+        if(clients > most) break;
+        while((int)idle.size() < clients) idle.push_back(Connect());
+
+        char ping[8] = { 0 };
+        for(int i = 0; i < pings / 10; i ++) {
+            WriteFully(stream, ping, sizeof(ping));
+            ReadFully(target, ping, sizeof(ping));
+        }
+
+        auto start = chrono::steady_clock::now();
+        for(int i = 0; i < pings; i ++) {
+            WriteFully(stream, ping, sizeof(ping));
+            ReadFully(target, ping, sizeof(ping));
+        }
+        auto end = chrono::steady_clock::now();
+
+        printf("%10d %14.2f\n", clients, chrono::duration<double, micro>(end - start).count() / pings);
+    }
+
+    for(int fd : idle) close(fd);
+    close(stream);
+    close(target);
+    close(syncer);
+    waitpid(pid, nullptr, 0);
+}
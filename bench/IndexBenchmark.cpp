@@ -0,0 +1,68 @@
+// Compares the store's FlatIndex against the std::map the cache levels used to be.
+// g++ -O2 -o index_bench bench/IndexBenchmark.cpp && ./index_bench [keys]
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "../FlatIndex.hpp"
+
+using namespace std;
+
+vector<string> RandomKeys(size_t n, mt19937_64 &rng) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    vector<string> keys(n);
+    for(auto &key : keys) {
+        key.resize(16);
+        for(auto &c : key) c = alphabet[rng() % 36];
+    }
+    return keys;
+}
+
+template<class F>
+double NsPerOp(size_t ops, F &&f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(end - start).count() / ops;
+}
+
+template<class Map>
+void Run(const char *name, const vector<string> &keys, const vector<string> &lookups, const vector<string> &misses) {
+    Map m;
+    size_t found = 0;
+
+    double set = NsPerOp(keys.size(), [&] {
+        for(auto &key : keys) m[key] = key;
+    });
+    double hit = NsPerOp(lookups.size(), [&] {
+        for(auto &key : lookups) found += m.find(key) != m.end();
+    });
+    double miss = NsPerOp(misses.size(), [&] {
+        for(auto &key : misses) found += m.find(key) != m.end();
+    });
+    double del = NsPerOp(lookups.size(), [&] {
+        for(auto &key : lookups) m.erase(key);
+    });
+
+    printf("%-10s %10.1f %10.1f %10.1f %10.1f   (%zu)\n", name, set, hit, miss, del, found);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? atol(argv[1]) : 1000000;
+    mt19937_64 rng(42);
+
+    vector<string> keys = RandomKeys(n, rng);
+    vector<string> lookups = keys;
+    shuffle(lookups.begin(), lookups.end(), rng);
+    vector<string> misses = RandomKeys(n, rng);
+
+    printf("%zu keys, ns/op\n", n);
+    printf("%-10s %10s %10s %10s %10s\n", "index", "SET", "GET hit", "GET miss", "DELETE");
+    Run<map<string, string>>("std::map", keys, lookups, misses);
+    Run<FlatIndex<string, string>>("FlatIndex", keys, lookups, misses);
+    return 0;
+}
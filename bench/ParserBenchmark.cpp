@@ -0,0 +1,114 @@
+// Cost of parsing a command line: the string_view parser of Command.hpp against the copying one
+// it replaced, which took the line by value, cut it up with substr and looked the name up in a
+// std::map. Every allocation goes through the operator new below and is counted.
+// g++ -O2 -o parser_bench bench/ParserBenchmark.cpp && ./parser_bench [commands]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include "../Command.hpp"
+
+using namespace std;
+
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations ++;
+    if(void *p = malloc(size)) return p;
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// the parser as it was
+struct OldCommand {
+    CMD CMDEnum;
+    string key = "";
+    string value = "";
+    time_t TTL = 0;
+};
+
+map<string, CMD> names = [] {
+    map<string, CMD> m;
+    for(size_t i = 0; i < CMD_COUNT; i ++)
+        m[string(CMDNames[i])] = CMD(i);
+    return m;
+}();
+
+OldCommand OldParser(string raw) {
+    OldCommand cmd = { ERROR, "", "", 0 };
+    size_t p = raw.find(' ');
+    string temp = raw.substr(0, p);
+
+    if(names.find(temp) == names.end())
+        return { ERROR, "", "", 0 };
+
+    cmd.CMDEnum = names[temp];
+
+    if((p == raw.npos) ^ (cmd.CMDEnum < GET)) return { ERROR, "", "", 0 };
+    if(p == raw.npos) return cmd;
+
+    raw = raw.substr(p + 1);
+    p = raw.find(' ');
+    cmd.key = raw.substr(0, p);
+
+    if((p == raw.npos) ^ (cmd.CMDEnum < SET)) return { ERROR, "", "", 0 };
+    if(p == raw.npos) return cmd;
+
+    raw = raw.substr(p + 1);
+    p = raw.find(' ');
+    cmd.value = raw.substr(0, p);
+
+    if(p == raw.npos) return { ERROR, "", "", 0 };
+
+    raw = raw.substr(p + 1);
+    p = raw.find(' ');
+    if(p != raw.npos) return { ERROR, "", "", 0 };
+
+    cmd.TTL = atoll(raw.c_str());
+    if(cmd.TTL <= 0) return { ERROR, "", "", 0 };
+
+    return cmd;
+}
+
+template<class Parse>
+void Measure(const char *name, const vector<string> &lines, int commands, Parse parse) {
+    size_t checksum = 0, before = allocations;
+    auto start = chrono::steady_clock::now();
+    for(int i = 0; i < commands; i ++)
+        checksum += parse(lines[i % lines.size()]);
+    auto end = chrono::steady_clock::now();
+
+    double ns = chrono::duration<double, nano>(end - start).count() / commands;
+    printf("%10s %12.1f %16.2f %10zu\n", name, ns, (double)(allocations - before) / commands, checksum);
+}
+
+int main(int argc, char **argv) {
+    int commands = argc > 1 ? atoi(argv[1]) : 5000000;
+
+    // keys and values past the small string buffer, as a session store would see them
+    vector<string> lines = {
+        "SET USER:1000:SESSION 7F3A9C2E4B1D8F6A0C5E3B7D9A1F4C8E 3600",
+        "GET USER:1000:SESSION",
+        "PSET RATE:LIMIT:192.168.100.200 REMAINING_REQUESTS_42 1500",
+        "DELETE USER:1000:SESSION",
+        "GET CACHE:PAGE:/INDEX.HTML",
+        "SIZE",
+        "SET A B 0",
+        "UNKNOWN COMMAND",
+    };
+
+    printf("%10s %12s %16s %10s\n", "parser", "ns/command", "allocs/command", "checksum");
+    Measure("copying", lines, commands, [](const string &line) {
+        OldCommand cmd = OldParser(line);
+        return cmd.CMDEnum + cmd.key.size() + cmd.value.size() + cmd.TTL;
+    });
+    Measure("view", lines, commands, [](const string &line) {
+        CMDStructure cmd = InputParser(line);
+        return cmd.CMDEnum + cmd.key.size() + cmd.value.size() + cmd.TTL;
+    });
+}
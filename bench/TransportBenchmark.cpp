@@ -0,0 +1,139 @@
+// Cost of passing small messages between two processes on one host: TCP over loopback, a unix
+// socket and a shared memory ring (ShmRing.hpp). The stream sends messages with one write each,
+// the way a client propagates its commands; the round trip bounces one message back and forth.
+// A ring's end that has to wait sleeps on the ring's eventfds, as the client and the hub do.
+// g++ -O2 -o transport_bench bench/TransportBenchmark.cpp && ./transport_bench [messages]
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "../Frame.hpp"
+#include "../ShmRing.hpp"
+
+using namespace std;
+
+// one end of a channel: a socket, or a ring each way
+struct End {
+    int fd = -1;
+    ShmRing *in = nullptr, *out = nullptr;
+
+    void Send(const char *data, size_t size) {
+        if(fd != -1) WriteFully(fd, data, size);
+        else out->WriteAll(data, size, -1);
+    }
+
+    // whatever has arrived, at most size bytes
+    size_t Receive(char *data, size_t size) {
+        if(fd != -1) {
+            ssize_t bytes = read(fd, data, size);
+            return bytes > 0 ? bytes : 0;
+        }
+
+        size_t bytes;
+        while((bytes = in->Read(data, size)) == 0) in->Wait();
+        return bytes;
+    }
+
+    void ReceiveAll(char *data, size_t size) {
+        for(size_t got = 0; got < size; )
+            got += Receive(data + got, size - got);
+    }
+};
+
+void TcpPair(End &a, End &b) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    socklen_t len = sizeof(address);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(bind(listenfd, (sockaddr *)&address, len) == -1 || listen(listenfd, 1) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    getsockname(listenfd, (sockaddr *)&address, &len);
+
+    a.fd = socket(AF_INET, SOCK_STREAM, 0);
+    connect(a.fd, (sockaddr *)&address, len);
+    b.fd = accept(listenfd, nullptr, nullptr);
+    close(listenfd);
+
+    int one = 1;
+    setsockopt(a.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(b.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// microseconds the parent spends on its part while a child runs the other end
+template<class Parent, class Child>
+double Timed(Parent parent, Child child) {
+    pid_t pid = fork();
+    if(pid == 0) {
+        child();
+        _exit(0);
+    }
+
+    auto start = chrono::steady_clock::now();
+    parent();
+    auto end = chrono::steady_clock::now();
+    waitpid(pid, nullptr, 0);
+    return chrono::duration<double, micro>(end - start).count();
+}
+
+void Measure(const char *name, End a, End b, int messages) {
+    static char chunk[1 << 16];
+    for(size_t size : { 64, 1024 }) {
+        string message(size, 'x');
+
+        // the child acknowledges the whole stream with a byte of its own
+        double stream = Timed([&] {
+            for(int i = 0; i < messages; i ++)
+                a.Send(message.data(), size);
+            a.ReceiveAll(chunk, 1);
+        }, [&] {
+            for(size_t got = 0; got < size * messages; )
+                got += b.Receive(chunk, sizeof(chunk));
+            b.Send(chunk, 1);
+        });
+
+        int rounds = messages / 10;
+        double trips = Timed([&] {
+            for(int i = 0; i < rounds; i ++) {
+                a.Send(message.data(), size);
+                a.ReceiveAll(chunk, size);
+            }
+        }, [&] {
+            for(int i = 0; i < rounds; i ++) {
+                b.ReceiveAll(chunk, size);
+                b.Send(chunk, size);
+            }
+        });
+
+        printf("%10s %8zu %10d %16.2f %16.2f\n", name, size, messages, messages / stream, trips / rounds);
+    }
+}
+
+int main(int argc, char **argv) {
+    int messages = argc > 1 ? atoi(argv[1]) : 200000;
+
+    printf("%10s %8s %10s %16s %16s\n", "transport", "size", "messages", "Mmsg/s one way", "round trip us");
+
+    End a, b;
+    TcpPair(a, b);
+    Measure("tcp", a, b, messages);
+    close(a.fd);
+    close(b.fd);
+
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    Measure("unix", { fds[0] }, { fds[1] }, messages);
+    close(fds[0]);
+    close(fds[1]);
+
+    ShmRing there(1 << 20), back(1 << 20);
+    Measure("shm ring", { -1, &back, &there }, { -1, &there, &back }, messages);
+}